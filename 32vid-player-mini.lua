@@ -17,7 +17,8 @@ end
 if file.read(4) ~= "32VD" then file.close() error("Not a 32Vid file") end
 local width, height, fps, nstreams, flags = ("<HHBBH"):unpack(file.read(8))
 --print(width, height, fps, nstreams, flags)
-if nstreams ~= 1 then file.close() error("Separate stream files not supported by this tool") end
+-- a combined stream may be followed by its index table, which isn't needed for playing from the start
+if nstreams ~= 1 and nstreams ~= 2 then file.close() error("Separate stream files not supported by this tool") end
 if bit32_band(flags, 1) == 0 then file.close() error("DEFLATE or no compression not supported by this tool") end
 local _, nframes, ctype = ("<IIB"):unpack(file.read(9))
 if ctype ~= 0x0C then file.close() error("Stream type not supported by this tool") end
@@ -133,28 +134,56 @@ else
     error("Unimplemented!")
 end
 
+local function readRun()
+    local n, shift = 0, 1
+    repeat
+        local b = file.read()
+        n, shift = n + bit32_band(b, 0x7F) * shift, shift * 128
+    until b < 0x80
+    return n
+end
+
 local blitColors = {[0] = "0", "1", "2", "3", "4", "5", "6", "7", "8", "9", "a", "b", "c", "d", "e", "f"}
 local start = os.epoch "utc"
 local lastyield = start
 local vframe = 0
 local subs = {}
+local screen, bg, fg
 term.clear()
 for _ = 1, nframes do
     local size, ftype = ("<IB"):unpack(file.read(5))
     --print(size, ftype, file.seek())
-    if ftype == 0 then
+    if ftype == 0 or ftype == 14 then
         if os.epoch "utc" - lastyield > 3000 then sleep(0) lastyield = os.epoch "utc" end
         local dcstart = os.epoch "utc"
-        --print("init screen", vframe, file.seek())
-        init(false)
-        --print("read screen", vframe, file.seek())
-        local screen = read(width * height)
-        --print("init colors", vframe, file.seek())
-        init(true)
-        --print("read bg colors", vframe)
-        local bg = read(width * height)
-        --print("read fg colors", vframe)
-        local fg = read(width * height)
+        if ftype == 0 then
+            --print("init screen", vframe, file.seek())
+            init(false)
+            --print("read screen", vframe, file.seek())
+            screen = read(width * height)
+            --print("init colors", vframe, file.seek())
+            init(true)
+            --print("read bg colors", vframe)
+            bg = read(width * height)
+            --print("read fg colors", vframe)
+            fg = read(width * height)
+        else
+            -- delta frame: only the changed cells are stored, the rest are kept from the last frame
+            local changed, pos, isChanged = {}, 0, false
+            while pos < width * height do
+                local n = readRun()
+                if isChanged then for i = pos + 1, pos + n do changed[#changed+1] = i end end
+                pos, isChanged = pos + n, not isChanged
+            end
+            if #changed > 0 then
+                init(false)
+                local s = read(#changed)
+                init(true)
+                local b = read(#changed)
+                local f = read(#changed)
+                for i, p in ipairs(changed) do screen[p], bg[p], fg[p] = s[i], b[i], f[i] end
+            end
+        end
         local dctime = os.epoch "utc" - dcstart
         while os.epoch "utc" < start + vframe * 1000 / fps do end
         local texta, fga, bga = {}, {}, {}
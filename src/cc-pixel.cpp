@@ -36,7 +36,10 @@
 #define get_local_size(n) 64
 #define get_global_size(n) 0
 #define barrier(n) ((void)0)
+#define mem_fence(n) ((void)0)
 #define atomic_inc(n) (*n++)
+#define atomic_add(p, v) (*(p) += (v))
+#define atomic_max(p, v) (*(p) = *(p) > (uint)(v) ? *(p) : (uint)(v))
 #define CLK_LOCAL_MEM_FENCE 0
 #define CLK_GLOBAL_MEM_FENCE 0
 
@@ -426,14 +429,19 @@ static float3 closestPixel(float3 pix, __constant uchar * palette, uchar palette
     return closest;
 }
 
-__kernel void thresholdKernel(__global const uchar * image, __global uchar * output, __constant uchar * palette, uchar palette_size) {
+__kernel void thresholdKernel(__global const uchar * image, __global uchar * output, __constant uchar * palette, uchar palette_size, ulong size) {
     __private float3 pix, closest;
+    if (get_global_id(0) >= size) return;
     pix.x = image[get_global_id(0)*3]; pix.y = image[get_global_id(0)*3+1]; pix.z = image[get_global_id(0)*3+2];
     closest = closestPixel(pix, palette, palette_size, NULL);
     output[get_global_id(0)*3] = closest.x; output[get_global_id(0)*3+1] = closest.y; output[get_global_id(0)*3+2] = closest.z;
 }
 
 // Adapted from https://community.arm.com/arm-community-blogs/b/graphics-gaming-and-vr-blog/posts/when-parallelism-gets-tricky-accelerating-floyd-steinberg-on-the-mali-gpu
+// Each work item dithers one row, staying two pixels behind the row above. Rows are handed out in the order
+// workgroups start, so a workgroup only ever waits on one that is already running. Work items in a workgroup
+// wait on each other too, so devices that run them one after another (CPUs) need a workgroup size of 1.
+// error, workgroup_rider and workgroup_progress must be zeroed before running.
 __kernel void floydSteinbergDither(
     __global const uchar * image,
     __global uchar * output,
@@ -461,6 +469,7 @@ __kernel void floydSteinbergDither(
     yoff = id*width;
     for (x = 0; x < width;) {
         if (get_local_id(0) == 0 ? workgroup_number == 0 || workgroup_progress[workgroup_number-1] >= x + 2 : progress[get_local_id(0)-1] >= x + 2) {
+            mem_fence(CLK_GLOBAL_MEM_FENCE); // don't read the error from the row above before its progress
             if (id < height) {
                 pix.x = image[(yoff+x)*3]; pix.y = image[(yoff+x)*3+1]; pix.z = image[(yoff+x)*3+2];
                 pix += vload3(yoff + x, error);
@@ -474,11 +483,13 @@ __kernel void floydSteinbergDither(
                 if (x > 0) vstore3(vload3(yoff + width + x - 1, error) + (err * 0.125f), yoff + width + x - 1, error);
                 vstore3(vload3(yoff + width + x, error) + (err * 0.1875f), yoff + width + x, error);
             }
+            mem_fence(CLK_GLOBAL_MEM_FENCE | CLK_LOCAL_MEM_FENCE); // the error has to be written before the row below sees the progress
             if (get_local_id(0) == get_local_size(0) - 1) workgroup_progress[workgroup_number] = x;
             else progress[get_local_id(0)] = x;
             x++;
         }
     }
+    mem_fence(CLK_GLOBAL_MEM_FENCE | CLK_LOCAL_MEM_FENCE);
     if (get_local_id(0) == get_local_size(0) - 1) workgroup_progress[workgroup_number] = width + 2;
     else progress[get_local_id(0)] = width + 2;
 }
@@ -513,6 +524,54 @@ __kernel void rgbToPaletteKernel(__global const uchar * image, __global uchar *
     }
 }
 
+// Moves the darkest color of a generated palette to the end and the lightest to the start, like reducePalette_medianCut
+__kernel void arrangePalette(__global uchar * palette, uchar palette_size) {
+    __private uchar order[16];
+    __private uchar tmp[48];
+    __private int i, n = 0, sum, darkest = 0, lightest = 0, dsum, lsum;
+    if (get_global_id(0) != 0) return;
+    dsum = lsum = palette[0] + palette[1] + palette[2];
+    for (i = 1; i < palette_size; i++) {
+        sum = palette[i*3] + palette[i*3+1] + palette[i*3+2];
+        if (sum < dsum) {darkest = i; dsum = sum;}
+        if (sum > lsum) {lightest = i; lsum = sum;}
+    }
+    order[n++] = lightest;
+    for (i = 0; i < palette_size; i++) if (i != darkest && i != lightest) order[n++] = i;
+    if (darkest == lightest) n--; // all colors are the same, so drop one more to keep the size
+    order[n++] = darkest;
+    for (i = 0; i < n * 3; i++) tmp[i] = palette[order[i/3]*3 + i%3];
+    for (i = 0; i < n * 3; i++) palette[i] = tmp[i];
+}
+
+__kernel void labPaletteToRGB(__global const uchar * palette, __global uchar * output, uchar palette_size) {
+    __private float X, Y, Z, R, G, B;
+    if (get_global_id(0) >= palette_size) return;
+    palette += get_global_id(0) * 3;
+    output += get_global_id(0) * 3;
+    Y = (palette[0] + 16.0) / 116.0;
+    X = (palette[1] - 128.0) / 500.0 + Y; Z = Y - (palette[2] - 128.0) / 200.0;
+    if (Y*Y*Y > 0.008856) Y = Y*Y*Y;
+    else Y = (Y - 16.0 / 116.0) / 7.787;
+    if (X*X*X > 0.008856) X = X*X*X;
+    else X = (X - 16.0 / 116.0) / 7.787;
+    if (Z*Z*Z > 0.008856) Z = Z*Z*Z;
+    else Z = (Z - 16.0 / 116.0) / 7.787;
+    X *= 0.95047; Z *= 1.08883;
+    R = X *  3.2406 + Y * -1.5372 + Z * -0.4986;
+    G = X * -0.9689 + Y *  1.8758 + Z *  0.0415;
+    B = X *  0.0557 + Y * -0.2040 + Z *  1.0570;
+    if (R > 0.0031308) R = 1.055 * pow(R, 1.0 / 2.4) - 0.055;
+    else R = 12.92 * R;
+    if (G > 0.0031308) G = 1.055 * pow(G, 1.0 / 2.4) - 0.055;
+    else G = 12.92 * G;
+    if (B > 0.0031308) B = 1.055 * pow(B, 1.0 / 2.4) - 0.055;
+    else B = 12.92 * B;
+    output[0] = R < 0 ? 0 : R > 1 ? 255 : R * 255;
+    output[1] = G < 0 ? 0 : G > 1 ? 255 : G * 255;
+    output[2] = B < 0 ? 0 : B > 1 ? 255 : B * 255;
+}
+
 __kernel void copyColors(__global const uchar * input, __global uchar * colors, ulong width, ulong height) {
     __private ulong y = get_global_id(0) * 2 / width, x = get_global_id(0) * 2 % width;
     if (y >= height) return;
@@ -520,379 +579,171 @@ __kernel void copyColors(__global const uchar * input, __global uchar * colors,
     colors[(y-y%3)*width + x*3 + (y%3)*2 + 1] = x == width - 1 ? 15 : input[y*width+x+1];
 }
 
-__kernel void calculateRange_A(__global const uchar * input, __global uchar * ranges, ulong n, ulong offset) {
-    __private ulong i;
-    __private uchar minr = 255, ming = 255, minb = 255, maxr = 0, maxg = 0, maxb = 0, r, g, b;
-    __private int id = get_global_id(0);
-    if (id * 128 >= n) return;
-    input += offset * 3;
-    for (i = id * 128; i < (id + 1) * 128 && i < n; i++) {
-        r = input[i*3]; g = input[i*3+1]; b = input[i*3+2];
-        if (r < minr) minr = r;
-        if (g < ming) ming = g;
-        if (b < minb) minb = b;
-        if (r > maxr) maxr = r;
-        if (g > maxg) maxg = g;
-        if (b > maxb) maxb = b;
-    }
-    ranges[id*6] = minr;
-    ranges[id*6+1] = ming;
-    ranges[id*6+2] = minb;
-    ranges[id*6+3] = maxr;
-    ranges[id*6+4] = maxg;
-    ranges[id*6+5] = maxb;
-}
+/* Median cut over per-box histograms: every pixel carries the index of the box it is in (as a node of a binary tree, the root being 1),
+   and each level of the tree takes a histogram, a split and an assignment pass, so no pixels ever have to be sorted */
 
-__kernel void calculateRange_B(__global const uchar * input, __global uchar * components, ulong n, uchar id) {
-    __private ulong i;
-    __private uchar minr = 255, ming = 255, minb = 255, maxr = 0, maxg = 0, maxb = 0, ranges[3], maxComponent;
-    for (i = 0; i < n; i++) {
-        if (input[i*6] < minr) minr = input[i*6];
-        if (input[i*6+1] < ming) ming = input[i*6+1];
-        if (input[i*6+2] < minb) minb = input[i*6+2];
-        if (input[i*6+3] > maxr) maxr = input[i*6+3];
-        if (input[i*6+4] > maxg) maxg = input[i*6+4];
-        if (input[i*6+5] > maxb) maxb = input[i*6+5];
+/* stats holds max(255 - c) and max(c) for each channel of a box, so both bounds can be found with atomic_max */
+static uint medianCutAxis(__global const uint * stats, __private uint node, __private uint lastComponent) {
+    __private int ranges[3], c, maxComponent;
+    for (c = 0; c < 3; c++) {
+        ranges[c] = (int)stats[node*6+3+c] - (255 - (int)stats[node*6+c]);
+        if (ranges[c] < 0) ranges[c] = 0;
     }
-    ranges[0] = maxr - minr;
-    ranges[1] = maxg - ming;
-    ranges[2] = maxb - minb;
     if (ranges[0] > ranges[1] && ranges[0] > ranges[2]) maxComponent = 0;
     else if (ranges[1] > ranges[0] && ranges[1] > ranges[2]) maxComponent = 1;
     else maxComponent = 2;
-    if (maxComponent == components[id >> 1]) {
-        if (abs((int)ranges[maxComponent] - (int)ranges[(maxComponent+1)%3]) < 8 && abs((int)ranges[maxComponent] - (int)ranges[(maxComponent+2)%3]) < 8)
+    if ((uint)maxComponent == lastComponent) {
+        if (abs(ranges[maxComponent] - ranges[(maxComponent+1)%3]) < 8 && abs(ranges[maxComponent] - ranges[(maxComponent+2)%3]) < 8)
             maxComponent = ranges[(maxComponent+1)%3] > ranges[(maxComponent+2)%3] ? (maxComponent + 1) % 3 : (maxComponent + 2) % 3;
-        else if (abs((int)ranges[maxComponent] - (int)ranges[(maxComponent+1)%3]) < 8) maxComponent = (maxComponent + 1) % 3;
-        else if (abs((int)ranges[maxComponent] - (int)ranges[(maxComponent+2)%3]) < 8) maxComponent = (maxComponent + 2) % 3;
+        else if (abs(ranges[maxComponent] - ranges[(maxComponent+1)%3]) < 8) maxComponent = (maxComponent + 1) % 3;
+        else if (abs(ranges[maxComponent] - ranges[(maxComponent+2)%3]) < 8) maxComponent = (maxComponent + 2) % 3;
     }
-    components[id] = maxComponent;
-}
-
-__kernel void diffuseKernel(__global uchar * buffer, ulong offset, ulong size, float step) {
-    if (offset + get_global_id(0) >= size) return;
-    vstore3(vload3(get_global_id(0) * step, buffer), offset + get_global_id(0), buffer);
+    return maxComponent;
 }
 
-__kernel void averageKernel_A(__global uchar * src, __global uint * result, ulong offset, ulong length) {
-    __private uint r = 0, g = 0, b = 0;
-    __private int i;
-    __private int id = get_global_id(0);
-    if (id * 128 >= length) return;
-    src += offset * 3;
-    for (i = id * 128; i < (id + 1) * 128 && i < length; i++) {
-        r += src[i*3]; g += src[i*3+1]; b += src[i*3+2];
+/* moves each pixel into the child box of its split (or into the root box at level 0), then adds it to the ranges of its new box, or to the color sums once the boxes are leaves */
+__kernel void medianCutAssign(__global const uchar * image, __global ushort * nodes, __global const uint * splits, __global uint * stats, __global uint * sums, ulong size, uint numColors, uint level, __local uint * aux) {
+    __private ulong id = get_global_id(0);
+    __private uint i, node = 1, leaves = (1u << level) >= numColors, n = numColors * 6;
+    __private uchar3 pix;
+    for (i = get_local_id(0); i < n; i += get_local_size(0)) aux[i] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (id < size) {
+        pix = vload3(id, image);
+        if (level > 0) {
+            node = nodes[id];
+            node = node * 2 + (getComponent(pix, splits[node*2]) > splits[node*2+1]);
+        }
+        nodes[id] = node;
+        if (leaves) {
+            i = (node - numColors) * 4;
+            atomic_add(&aux[i], 1);
+            atomic_add(&aux[i+1], pix.x);
+            atomic_add(&aux[i+2], pix.y);
+            atomic_add(&aux[i+3], pix.z);
+        } else {
+            atomic_max(&aux[node*6], 255 - pix.x);
+            atomic_max(&aux[node*6+1], 255 - pix.y);
+            atomic_max(&aux[node*6+2], 255 - pix.z);
+            atomic_max(&aux[node*6+3], pix.x);
+            atomic_max(&aux[node*6+4], pix.y);
+            atomic_max(&aux[node*6+5], pix.z);
+        }
     }
-    result[id*3] = r; result[id*3+1] = g; result[id*3+2] = b;
-}
-
-__kernel void averageKernel_B(__global uint * src, __global uchar * result, ulong offset, ulong length) {
-    __private uint r = 0, g = 0, b = 0;
-    __private int i;
-    for (i = 0; i < length / 128 + (length % 128 ? 1 : 0); i++) {
-        r += src[i*3]; g += src[i*3+1]; b += src[i*3+2];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (i = get_local_id(0); i < n; i += get_local_size(0)) {
+        if (aux[i] == 0) continue;
+        if (leaves) atomic_add(&sums[i], aux[i]);
+        else atomic_max(&stats[i], aux[i]);
     }
-    result[offset*3] = r / length; result[offset*3+1] = g / length; result[offset*3+2] = b / length;
 }
 
-__kernel void kMeans_bucket_kernel(__global const uchar * image, __global uchar * buckets, __constant uchar * palette, ulong palette_size) {
-    __private float3 pix;
-    pix.x = image[get_global_id(0)*3]; pix.y = image[get_global_id(0)*3+1]; pix.z = image[get_global_id(0)*3+2];
-    closestPixel(pix, palette, palette_size, buckets + get_global_id(0));
+__kernel void medianCutHistogram(__global const uchar * image, __global const ushort * nodes, __global const uint * stats, __global const uint * splits, __global uint * histogram, ulong size, uint level) {
+    __private ulong id = get_global_id(0);
+    __private uint node;
+    if (id >= size) return;
+    node = nodes[id];
+    atomic_add(&histogram[(node - (1u << level)) * 256 + getComponent(vload3(id, image), medianCutAxis(stats, node, splits[(node >> 1) * 2]))], 1);
 }
 
-__kernel void kMeans_recenter_kernel_A(__global const uchar * image, __global const uchar * buckets, __global uint * output, ulong length, __local uchar * buckets_aux) {
-    __private uint id = get_group_id(0), color = get_local_id(0), numColors = get_local_size(0), r = 0, g = 0, b = 0, total = 0;
-    __private ulong offset = id * 128;
-    __private int i;
-    barrier(CLK_LOCAL_MEM_FENCE);
-    for (i = 0; i < 128; i++) buckets_aux[i] = buckets[offset+i];
+/* one workgroup per box; a prefix sum over the histogram finds the value that puts the closest to half of the pixels on each side */
+__kernel void medianCutSplit(__global const uint * stats, __global uint * splits, __global const uint * histogram, uint level, __local uint * scan) {
+    __private uint node = (1u << level) + get_group_id(0), t = get_local_id(0), n = get_local_size(0), per = 256 / get_local_size(0);
+    __private uint i, v, off, sum = 0, cum, lt, total, target, comp;
+    __global const uint * bins = histogram + get_group_id(0) * 256 + t * per;
+    for (i = 0; i < per; i++) sum += bins[i];
+    scan[t] = sum;
     barrier(CLK_LOCAL_MEM_FENCE);
-    for (i = 0; i < 128 && i + offset < length; i++) {
-        if (buckets_aux[i] == color) {
-            r += image[(offset+i)*3]; g += image[(offset+i)*3+1]; b += image[(offset+i)*3+2]; total++;
-        }
+    for (off = 1; off < n; off <<= 1) {
+        v = t >= off ? scan[t - off] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        scan[t] += v;
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
-    output[id*numColors*4+color*4] = r;
-    output[id*numColors*4+color*4+1] = g;
-    output[id*numColors*4+color*4+2] = b;
-    output[id*numColors*4+color*4+3] = total;
-}
-
-__kernel void kMeans_recenter_kernel_B(__global const uint * src, __global uchar * palette, ulong nparts, __global uchar * changed) {
-    __private uint color = get_global_id(0), numColors = get_global_size(0), r = 0, g = 0, b = 0, total = 0;
-    __private uchar o_r, o_g, o_b, n_r, n_g, n_b;
-    __private int i;
-    for (i = 0; i < nparts; i++) {
-        r += src[i*numColors*4+color*4];
-        g += src[i*numColors*4+color*4+1];
-        b += src[i*numColors*4+color*4+2];
-        total += src[i*numColors*4+color*4+3];
+    total = scan[n - 1];
+    target = total > 1 ? total / 2 : 1;
+    comp = medianCutAxis(stats, node, splits[(node >> 1) * 2]);
+    if (t == 0) {
+        splits[node*2] = comp;
+        if (total == 0) splits[node*2+1] = 255;
     }
-    o_r = palette[color*3];
-    n_r = r / total;
-    palette[color*3] = n_r;
-    o_g = palette[color*3+1];
-    n_g = g / total;
-    palette[color*3+1] = n_g;
-    o_b = palette[color*3+2];
-    n_b = b / total;
-    palette[color*3+2] = n_b;
-    if (o_r != n_r || o_g != n_g || o_b != n_b) *changed = 1;
-}
-
-/* Sorting code from Eric Bainville, BSD-style license */
-/* Retrieved from http://www.bealto.com/gpu-sorting_parallel-bitonic-2.html */
-
-typedef uchar3 data_t;
-
-static uchar getKey(uchar3 v, uchar n) {
-    switch (n) {
-        case 0: return v.x;
-        case 1: return v.y;
-        case 2: return v.z;
-        default: return 0;
+    cum = scan[t] - sum;
+    for (i = 0; i < per; i++) {
+        lt = cum;
+        cum += bins[i];
+        /* values equal to the median can only go to one side, so take whichever side leaves the boxes closer to even */
+        if (lt < target && cum >= target)
+            splits[node*2+1] = lt > 0 && (cum == total || target - lt < cum - target) ? t * per + i - 1 : t * per + i;
     }
 }
 
-#define ORDER(a,b,c) { bool swap = reverse ^ (getKey(a,c)<getKey(b,c)); data_t auxa = a; data_t auxb = b; a = (swap)?auxb:auxa; b = (swap)?auxa:auxb; }
-
-// N/2 threads
-__kernel void ParallelBitonic_B2(__global uchar *data, int inc, int dir, __constant uchar * components, uchar compid, ulong offset) {
-    int t = get_global_id(0);        // thread index
-    int low = t & (inc - 1);         // low order bits (below INC)
-    int i = (t << 1) - low;          // insert 0 at position INC
-    bool reverse = ((dir & i) == 0); // asc/desc order
-    data += (i + offset) * 3;        // translate to first value
-
-    // Load
-    data_t x0 = vload3(0, data);
-    data_t x1 = vload3(inc, data);
-
-    // Sort
-    ORDER(x0, x1, components[compid])
-
-    // Store
-    vstore3(x0, 0, data);
-    vstore3(x1, inc, data);
-}
-
-// N/4 threads
-__kernel void ParallelBitonic_B4(__global uchar *data, int inc, int dir, __constant uchar * components, uchar compid, ulong offset) {
-    inc >>= 1;
-    int t = get_global_id(0);        // thread index
-    int low = t & (inc - 1);         // low order bits (below INC)
-    int i = ((t - low) << 2) + low;  // insert 00 at position INC
-    bool reverse = ((dir & i) == 0); // asc/desc order
-    data += (i + offset) * 3;        // translate to first value
-
-    // Load
-    data_t x0 = vload3(0, data);
-    data_t x1 = vload3(inc, data);
-    data_t x2 = vload3(2 * inc, data);
-    data_t x3 = vload3(3 * inc, data);
-
-    // Sort
-    ORDER(x0, x2, components[compid])
-    ORDER(x1, x3, components[compid])
-    ORDER(x0, x1, components[compid])
-    ORDER(x2, x3, components[compid])
-
-    // Store
-    vstore3(x0, 0, data);
-    vstore3(x1, inc, data);
-    vstore3(x2, 2 * inc, data);
-    vstore3(x3, 3 * inc, data);
-}
-
-#define ORDERV(x,a,b,c) { bool swap = reverse ^ (getKey(x[a],c)<getKey(x[b],c)); \
-      data_t auxa = x[a]; data_t auxb = x[b]; \
-      x[a] = (swap)?auxb:auxa; x[b] = (swap)?auxa:auxb; }
-#define B2V(x,a,c) { ORDERV(x,a,a+1,c) }
-#define B4V(x,a,c) { for (int i4=0;i4<2;i4++) { ORDERV(x,a+i4,a+i4+2,c) } B2V(x,a,c) B2V(x,a+2,c) }
-#define B8V(x,a,c) { for (int i8=0;i8<4;i8++) { ORDERV(x,a+i8,a+i8+4,c) } B4V(x,a,c) B4V(x,a+4,c) }
-#define B16V(x,a,c) { for (int i16=0;i16<8;i16++) { ORDERV(x,a+i16,a+i16+8,c) } B8V(x,a,c) B8V(x,a+8,c) }
-
-// N/8 threads
-__kernel void ParallelBitonic_B8(__global uchar *data, int inc, int dir, __constant uchar * components, uchar compid, ulong offset) {
-    inc >>= 2;
-    int t = get_global_id(0);        // thread index
-    int low = t & (inc - 1);         // low order bits (below INC)
-    int i = ((t - low) << 3) + low;  // insert 000 at position INC
-    bool reverse = ((dir & i) == 0); // asc/desc order
-    data += (i + offset) * 3;        // translate to first value
-
-    // Load
-    data_t x[8];
-    for (int k = 0; k < 8; k++) x[k] = vload3(k * inc, data);
-
-    // Sort
-    B8V(x, 0, components[compid])
-
-    // Store
-    for (int k = 0; k < 8; k++) vstore3(x[k], k * inc, data);
-}
-
-// N/16 threads
-__kernel void ParallelBitonic_B16(__global uchar *data, int inc, int dir, __constant uchar * components, uchar compid, ulong offset) {
-    inc >>= 3;
-    int t = get_global_id(0);        // thread index
-    int low = t & (inc - 1);         // low order bits (below INC)
-    int i = ((t - low) << 4) + low;  // insert 0000 at position INC
-    bool reverse = ((dir & i) == 0); // asc/desc order
-    data += (i + offset) * 3;        // translate to first value
-
-    // Load
-    data_t x[16];
-    for (int k = 0; k < 16; k++) x[k] = vload3(k * inc, data);
-
-    // Sort
-    B16V(x, 0, components[compid])
-
-    // Store
-    for (int k = 0; k < 16; k++) vstore3(x[k], k * inc, data);
-}
-
-// N/2 threads, AUX[2*WG]
-__kernel void ParallelBitonic_C2_pre(__global uchar *data, int inc, int dir, __constant uchar * components, uchar compid, ulong offset, __local uchar *aux) {
-    int t = get_global_id(0); // thread index
-    data += offset * 3;
-
-    // Terminate the INC loop inside the workgroup
-    for (; inc > 0; inc >>= 1) {
-        int low = t & (inc - 1);         // low order bits (below INC)
-        int i = (t << 1) - low;          // insert 0 at position INC
-        bool reverse = ((dir & i) == 0); // asc/desc order
-
-        barrier(CLK_GLOBAL_MEM_FENCE);
-
-        // Load
-        data_t x0 = vload3(i, data);
-        data_t x1 = vload3(i + inc, data);
-
-        // Sort
-        ORDER(x0, x1, components[compid])
-
-        barrier(CLK_GLOBAL_MEM_FENCE);
-
-        // Store
-        vstore3(x0, i, data);
-        vstore3(x1, i + inc, data);
-    }
-}
-
-// N/2 threads, AUX[2*WG]
-__kernel void ParallelBitonic_C2(__global uchar *data, int inc0, int dir, __constant uchar * components, uchar compid, ulong offset, __local uchar *aux) {
-    int t = get_global_id(0);               // thread index
-    int wgBits = 2 * get_local_size(0) - 1; // bit mask to get index in local memory AUX (size is 2*WG)
-    data += offset * 3;
-
-    for (int inc = inc0; inc > 0; inc >>= 1) {
-        int low = t & (inc - 1);         // low order bits (below INC)
-        int i = (t << 1) - low;          // insert 0 at position INC
-        bool reverse = ((dir & i) == 0); // asc/desc order
-        data_t x0, x1;
-
-        // Load
-        if (inc == inc0) {
-            // First iteration: load from global memory
-            x0 = vload3(i, data);
-            x1 = vload3(i + inc, data);
-        } else {
-            // Other iterations: load from local memory
-            barrier(CLK_LOCAL_MEM_FENCE);
-            x0 = vload3(i & wgBits, aux);
-            x1 = vload3((i + inc) & wgBits, aux);
-        }
-
-        // Sort
-        ORDER(x0, x1, components[compid])
-
-        // Store
-        if (inc == 1) {
-            // Last iteration: store to global memory
-            vstore3(x0, i, data);
-            vstore3(x1, i + inc, data);
-        } else {
-            // Other iterations: store to local memory
-            barrier(CLK_LOCAL_MEM_FENCE);
-            vstore3(x0, i & wgBits, aux);
-            vstore3(x1, (i + inc) & wgBits, aux);
+__kernel void medianCutAverage(__global const uint * sums, __global uchar * palette, uint numColors) {
+    __private uint color = get_global_id(0), group, start, i, total = 0, r = 0, g = 0, b = 0;
+    if (color >= numColors) return;
+    /* a box left empty takes the average of the smallest box above it that has any pixels */
+    for (group = 1; group <= numColors && total == 0; group <<= 1) {
+        start = color & ~(group - 1);
+        r = g = b = 0;
+        for (i = start; i < start + group; i++) {
+            total += sums[i*4];
+            r += sums[i*4+1];
+            g += sums[i*4+2];
+            b += sums[i*4+3];
         }
     }
+    if (total == 0) total = 1;
+    palette[color*3] = r / total;
+    palette[color*3+1] = g / total;
+    palette[color*3+2] = b / total;
 }
 
-// N/4 threads, AUX[4*WG]
-__kernel void ParallelBitonic_C4_0(__global uchar *data, int inc0, int dir, __constant uchar * components, uchar compid, ulong offset, __local uchar *aux) {
-    int t = get_global_id(0);               // thread index
-    int wgBits = 4 * get_local_size(0) - 1; // bit mask to get index in local memory AUX (size is 4*WG)
-    data += offset * 3;
-
-    for (int inc = inc0 >> 1; inc > 0; inc >>= 2) {
-        int low = t & (inc - 1);         // low order bits (below INC)
-        int i = ((t - low) << 2) + low;  // insert 00 at position INC
-        bool reverse = ((dir & i) == 0); // asc/desc order
-        data_t x[4];
-
-        // Load
-        if (inc == inc0 >> 1) {
-            // First iteration: load from global memory
-            for (int k = 0; k < 4; k++) x[k] = vload3(i + k * inc, data);
-        } else {
-            // Other iterations: load from local memory
-            barrier(CLK_LOCAL_MEM_FENCE);
-            for (int k = 0; k < 4; k++) x[k] = vload3((i + k * inc) & wgBits, aux);
-        }
-
-        // Sort
-        B4V(x, 0, components[compid]);
-
-        // Store
-        if (inc == 1) {
-            // Last iteration: store to global memory
-            for (int k = 0; k < 4; k++) vstore3(x[k], i + k * inc, data);
-        } else {
-            // Other iterations: store to local memory
-            barrier(CLK_LOCAL_MEM_FENCE);
-            for (int k = 0; k < 4; k++) vstore3(x[k], (i + k * inc) & wgBits, aux);
+/* k-means runs entirely on the device: *state is set once an update leaves the palette unchanged, after which any iterations
+   still in the queue return right away, so the host can enqueue several iterations between checks */
+
+/* puts each pixel into the bucket of its nearest color, summing the buckets in local memory before adding them to the global sums */
+__kernel void kMeans_assign_kernel(__global const uchar * image, __constant uchar * palette, __global uint * sums, __global const uint * state, ulong size, uint numColors, __local uint * aux) {
+    __private ulong id = get_global_id(0);
+    __private uint i, nearest = 0, dist, d, n = numColors * 4;
+    __private int dr, dg, db;
+    __private uchar3 pix;
+    if (*state) return;
+    for (i = get_local_id(0); i < n; i += get_local_size(0)) aux[i] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (id < size) {
+        pix = vload3(id, image);
+        dist = 0xFFFFFFFF;
+        for (i = 0; i < numColors; i++) {
+            dr = (int)pix.x - palette[i*3]; dg = (int)pix.y - palette[i*3+1]; db = (int)pix.z - palette[i*3+2];
+            d = dr*dr + dg*dg + db*db;
+            if (d < dist) {
+                dist = d;
+                nearest = i;
+            }
         }
+        atomic_add(&aux[nearest*4], pix.x);
+        atomic_add(&aux[nearest*4+1], pix.y);
+        atomic_add(&aux[nearest*4+2], pix.z);
+        atomic_add(&aux[nearest*4+3], 1);
     }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (i = get_local_id(0); i < n; i += get_local_size(0))
+        if (aux[i]) atomic_add(&sums[i], aux[i]);
 }
 
-__kernel void ParallelBitonic_C4(__global uchar *data, int inc0, int dir, __constant uchar * components, uchar compid, ulong offset, __local uchar *aux) {
-    int t = get_global_id(0);               // thread index
-    int wgBits = 4 * get_local_size(0) - 1; // bit mask to get index in local memory AUX (size is 4*WG)
-    int inc, low, i;
-    bool reverse;
-    data_t x[4];
-
-    // First iteration, global input, local output
-    data += offset * 3;
-    inc = inc0 >> 1;
-    low = t & (inc - 1);        // low order bits (below INC)
-    i = ((t - low) << 2) + low; // insert 00 at position INC
-    reverse = ((dir & i) == 0); // asc/desc order
-    for (int k = 0; k < 4; k++) x[k] = vload3(i + k * inc, data);
-    B4V(x, 0, components[compid]);
-    for (int k = 0; k < 4; k++) vstore3(x[k], (i + k * inc) & wgBits, aux);
+/* one workgroup with one item per color; moves each color to the average of its bucket and clears the sums for the next iteration */
+__kernel void kMeans_update_kernel(__global uint * sums, __global uchar * palette, __global uint * state, __local uint * changed) {
+    __private uint color = get_local_id(0), total = sums[color*4+3], r, g, b;
+    if (*state) return;
+    if (color == 0) *changed = 0;
     barrier(CLK_LOCAL_MEM_FENCE);
-
-    // Internal iterations, local input and output
-    for (; inc > 1; inc >>= 2) {
-        low = t & (inc - 1);        // low order bits (below INC)
-        i = ((t - low) << 2) + low; // insert 00 at position INC
-        reverse = ((dir & i) == 0); // asc/desc order
-        for (int k = 0; k < 4; k++) x[k] = vload3((i + k * inc) & wgBits, aux);
-        B4V(x, 0, components[compid]);
-        barrier(CLK_LOCAL_MEM_FENCE);
-        for (int k = 0; k < 4; k++) vstore3(x[k], (i + k * inc) & wgBits, aux);
-        barrier(CLK_LOCAL_MEM_FENCE);
+    if (total) {
+        r = sums[color*4] / total; g = sums[color*4+1] / total; b = sums[color*4+2] / total;
+        if (palette[color*3] != r || palette[color*3+1] != g || palette[color*3+2] != b) {
+            palette[color*3] = r; palette[color*3+1] = g; palette[color*3+2] = b;
+            *changed = 1;
+        }
     }
-
-    // Final iteration, local input, global output, INC=1
-    i = t << 2;
-    reverse = ((dir & i) == 0); // asc/desc order
-    for (int k = 0; k < 4; k++) x[k] = vload3((i + k) & wgBits, aux);
-    B4V(x, 0, components[compid]);
-    for (int k = 0; k < 4; k++) vstore3(x[k], i + k, data);
+    sums[color*4] = sums[color*4+1] = sums[color*4+2] = sums[color*4+3] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (color == 0 && *changed == 0) *state = 1;
 }
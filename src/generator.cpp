@@ -22,6 +22,7 @@
 #include <cstring>
 #include <algorithm>
 #include <sstream>
+#include <fstream>
 #include <stack>
 
 #ifndef NO_POCO
@@ -178,17 +179,19 @@ void makeCCImage(Mat1b& input, const std::vector<Vec3b>& palette, uchar** chars,
         *cols = new uchar[(height / 3) * (width / 2)];
         input.upload();
         try {
-            OpenCL::Memory<uchar> colors_mem(*device, height * width / 6, 6, false, true);
-            OpenCL::Memory<uchar> chars_mem(*device, (height / 3) * (width / 2), 1, *chars);
-            OpenCL::Memory<uchar> cols_mem(*device, (height / 3) * (width / 2), 1, *cols);
-            OpenCL::Memory<uchar> palette_mem(*device, palette.size(), 3, pal);
-            OpenCL::Kernel copykernel(*device, height * width / 2, "copyColors", *input.mem, colors_mem, (ulong)width, (ulong)height);
-            OpenCL::Kernel kernel(*device, height * width / 6, "toCCPixel", colors_mem, chars_mem, cols_mem, palette_mem, (ulong)(width * height));
+            OpenCL::Session& session = OpenCL::get_session(*device);
+            const size_t size = (height / 3) * (width / 2);
+            OpenCL::Memory<uchar>& colors_mem = session.buffer<uchar>("ccImage.colors", height * width / 6, 6, false);
+            OpenCL::Memory<uchar>& chars_mem = session.buffer<uchar>("ccImage.chars", size, 1, false);
+            OpenCL::Memory<uchar>& cols_mem = session.buffer<uchar>("ccImage.cols", size, 1, false);
+            OpenCL::Memory<uchar>& palette_mem = session.buffer<uchar>("ccImage.palette", 16, 3);
+            std::copy(pal, pal + 48, palette_mem.data());
             palette_mem.enqueue_write_to_device();
-            copykernel.enqueue_run();
-            kernel.enqueue_run();
-            chars_mem.enqueue_read_from_device();
-            cols_mem.enqueue_read_from_device();
+            session.kernel("copyColors", height * width / 2, *input.mem, colors_mem, (ulong)width, (ulong)height).enqueue_run();
+            session.kernel("toCCPixel", height * width / 6, colors_mem, chars_mem, cols_mem, palette_mem, (ulong)(width * height)).enqueue_run();
+            // Read straight into the results, so the only host sync for the frame is this one
+            device->get_cl_queue().enqueueReadBuffer(chars_mem.get_cl_buffer(), false, 0, size, *chars);
+            device->get_cl_queue().enqueueReadBuffer(cols_mem.get_cl_buffer(), false, 0, size, *cols);
             device->finish_queue();
         } catch (std::exception &e) {
             delete[] *chars;
@@ -234,13 +237,13 @@ void makeNFPCCImage(Mat1b& input, uchar** cols, OpenCL::Device * device) {
         *cols = new uchar[(height / 3) * (width / 2)];
         input.upload();
         try {
-            OpenCL::Memory<uchar> colors_mem(*device, height * width / 6, 6, false, true);
-            OpenCL::Memory<uchar> cols_mem(*device, (height / 3) * (width / 2), 1, *cols);
-            OpenCL::Kernel copykernel(*device, height * width / 2, "copyColors", *input.mem, colors_mem, (ulong)width, (ulong)height);
-            OpenCL::Kernel kernel(*device, height * width / 6, "toNFPPixel", colors_mem, cols_mem, (ulong)(width * height));
-            copykernel.enqueue_run();
-            kernel.enqueue_run();
-            cols_mem.enqueue_read_from_device();
+            OpenCL::Session& session = OpenCL::get_session(*device);
+            const size_t size = (height / 3) * (width / 2);
+            OpenCL::Memory<uchar>& colors_mem = session.buffer<uchar>("ccImage.colors", height * width / 6, 6, false);
+            OpenCL::Memory<uchar>& cols_mem = session.buffer<uchar>("ccImage.cols", size, 1, false);
+            session.kernel("copyColors", height * width / 2, *input.mem, colors_mem, (ulong)width, (ulong)height).enqueue_run();
+            session.kernel("toNFPPixel", height * width / 6, colors_mem, cols_mem, (ulong)(width * height)).enqueue_run();
+            device->get_cl_queue().enqueueReadBuffer(cols_mem.get_cl_buffer(), false, 0, size, *cols);
             device->finish_queue();
         } catch (std::exception &e) {
             delete[] *cols;
@@ -894,7 +897,7 @@ std::string make32vid_ans(const uchar * characters, const uchar * colors, const
     uchar * fgcolors = new uchar[width*height];
     uchar * bgcolors = new uchar[width*height];
     uchar *fgnext = fgcolors, *bgnext = bgcolors;
-    uchar fc = colors[0] >> 4, fn = 0, bc = colors[0] & 0xF, bn = 0;
+    uchar fc = colors[0] & 0xF, fn = 0, bc = colors[0] >> 4, bn = 0;
     bool fset = false, bset = false;
     // add weights for Huffman coding
     for (int i = 0; i < width * height; i++) {
@@ -1035,6 +1038,153 @@ std::string make32vid_ans(const uchar * characters, const uchar * colors, const
     return screen + col + pal;
 }
 
+std::string make32vid_delta(const uchar * characters, const uchar * colors, const std::vector<Vec3b>& palette, const uchar * lastCharacters, const uchar * lastColors, int width, int height) {
+    std::string runs;
+    std::vector<uchar> changedCharacters, changedColors;
+    int size = width * height;
+    // the mask is stored as alternating runs of unchanged and changed cells, starting with unchanged
+    bool inChanged = false;
+    uint32_t run = 0;
+    auto putRun = [&runs](uint32_t n) {
+        while (n >= 0x80) {
+            runs += (char)(0x80 | (n & 0x7F));
+            n >>= 7;
+        }
+        runs += (char)n;
+    };
+    for (int i = 0; i < size; i++) {
+        bool changed = colors[i] != lastColors[i] || (characters ? characters[i] : 0) != (lastCharacters ? lastCharacters[i] : 0);
+        if (changed != inChanged) {
+            putRun(run);
+            run = 0;
+            inChanged = changed;
+        }
+        run++;
+        if (changed) {
+            changedCharacters.push_back(characters ? characters[i] : 0);
+            changedColors.push_back(colors[i]);
+        }
+    }
+    putRun(run);
+    if (changedColors.empty()) {
+        std::string pal;
+        for (int i = 0; i < 16; i++) {
+            if (i < palette.size()) {
+                pal += palette[i][2];
+                pal += palette[i][1];
+                pal += palette[i][0];
+            } else pal += std::string((size_t)3, (char)0);
+        }
+        return runs + pal;
+    }
+    return runs + make32vid_ans(changedCharacters.data(), changedColors.data(), palette, changedColors.size(), 1);
+}
+
+std::string make32vid_index(const std::vector<uint32_t>& offsets, uint8_t step) {
+    Vid32Chunk chunk;
+    chunk.size = 1 + offsets.size() * 4;
+    chunk.nframes = offsets.size();
+    chunk.type = (uint8_t)Vid32Chunk::Type::CombinedIndex;
+    std::string retval((const char*)&chunk, 9);
+    retval += (char)step;
+    retval += std::string((const char*)offsets.data(), offsets.size() * 4);
+    return retval;
+}
+
 std::string makeLuaFile(const uchar * characters, const uchar * colors, const std::vector<Vec3b>& palette, int width, int height) {
     return "-- Generated with sanjuuni\n-- https://sanjuuni.madefor.cc\ndo\nlocal image, palette = " + makeTable(characters, colors, palette, width, height) + "\n\nterm.clear()\nfor i = 0, #palette do term.setPaletteColor(2^i, table.unpack(palette[i])) end\nfor y, r in ipairs(image) do\n    term.setCursorPos(1, y)\n    term.blit(table.unpack(r))\nend\nend\n";
 }
+
+std::string merge32vid(const std::vector<std::string>& inputs, std::ostream& out) {
+    Vid32Header header;
+    Vid32Chunk chunk;
+    chunk.size = chunk.nframes = 0;
+    chunk.type = (uint8_t)Vid32Chunk::Type::Combined;
+    std::streampos start = out.tellp();
+    bool hasAudio = false;
+    const std::string * first = NULL;
+    // the merged stream is indexed again, which only works if every indexed frame is a full frame
+    std::vector<uint32_t> index;
+    uint32_t nvideoTotal = 0;
+    int indexStep = 0;
+    bool indexable = true;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        std::ifstream in(inputs[i], std::ios::in | std::ios::binary);
+        if (!in.good()) return "Could not open " + inputs[i];
+        if (in.peek() == std::ifstream::traits_type::eof()) continue; // parts without any frames are left empty
+        Vid32Header h;
+        Vid32Chunk c;
+        in.read((char*)&h, 12);
+        in.read((char*)&c, 9);
+        if (!in.good() || memcmp(h.magic, "32VD", 4) != 0) return inputs[i] + " is not a 32vid file";
+        if (h.nstreams < 1 || h.nstreams > 2 || c.type != (uint8_t)Vid32Chunk::Type::Combined) return inputs[i] + " does not contain a single combined stream";
+        if (!first) {
+            first = &inputs[i];
+            header = h;
+            header.nstreams = 1;
+            out.write((char*)&header, 12);
+            out.write((char*)&chunk, 9);
+            // keep the parts' index spacing, or use one entry per second
+            indexStep = header.fps ? header.fps : 1;
+            if (h.nstreams == 2) {
+                Vid32Chunk ic;
+                in.seekg(c.size, std::ios::cur);
+                in.read((char*)&ic, 9);
+                int step = in.get();
+                if (in.good() && ic.type == (uint8_t)Vid32Chunk::Type::CombinedIndex && step > 0) indexStep = step;
+                in.clear();
+                in.seekg(21, std::ios::beg);
+            }
+        } else if (h.width != header.width || h.height != header.height || h.fps != header.fps || h.flags != header.flags) return inputs[i] + " does not have the same format as " + *first;
+        uint32_t nvideo = 0;
+        uint64_t naudio = 0;
+        std::vector<char> data;
+        for (uint32_t n = 0; n < c.nframes; n++) {
+            uint32_t size;
+            in.read((char*)&size, 4);
+            int type = in.get();
+            data.resize(size);
+            in.read(data.data(), size);
+            if (!in.good()) return inputs[i] + " is truncated";
+            if (type == (int)Vid32Chunk::Type::Video || type == (int)Vid32Chunk::Type::VideoDelta || type == (int)Vid32Chunk::Type::MultiMonitorVideo) {
+                if (nvideoTotal % indexStep == 0) {
+                    if (type == (int)Vid32Chunk::Type::VideoDelta) indexable = false;
+                    index.push_back(start + (std::streamoff)(21 + chunk.size));
+                }
+                nvideo++;
+                nvideoTotal++;
+            } else if (type == (int)Vid32Chunk::Type::Audio) naudio += (header.flags & VID32_FLAG_AUDIO_COMPRESSION_DFPWM) ? size * 8 : size;
+            out.write((char*)&size, 4);
+            out.put(type);
+            out.write(data.data(), size);
+            chunk.size += size + 5;
+            chunk.nframes++;
+        }
+        if (naudio) hasAudio = true;
+        if (hasAudio && header.fps && i + 1 < inputs.size()) {
+            uint64_t expected = (uint64_t)nvideo * 48000 / header.fps;
+            if (naudio > expected + 48000) return "Audio in " + inputs[i] + " is longer than its video; the parts may be out of order";
+            if (naudio < expected) {
+                // pad with silence (DFPWM alternates bits to stay centered)
+                std::string silence = (header.flags & VID32_FLAG_AUDIO_COMPRESSION_DFPWM) ? std::string((expected - naudio + 7) / 8, '\x55') : std::string(expected - naudio, '\x80');
+                uint32_t size = silence.size();
+                out.write((char*)&size, 4);
+                out.put((char)Vid32Chunk::Type::Audio);
+                out.write(silence.c_str(), size);
+                chunk.size += size + 5;
+                chunk.nframes++;
+            }
+        }
+    }
+    if (!first) return "No frames to merge";
+    if (indexable && !index.empty()) out << make32vid_index(index, indexStep);
+    std::streampos end = out.tellp();
+    if (indexable && !index.empty()) {
+        out.seekp(start + (std::streamoff)9);
+        out.put(2);
+    }
+    out.seekp(start + (std::streamoff)12);
+    out.write((char*)&chunk, 9);
+    out.seekp(end);
+    return out.good() ? "" : "Could not write merged video";
+}
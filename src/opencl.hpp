@@ -35,9 +35,14 @@
 
 #include <cmath>
 #include <algorithm>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <new>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <CL/opencl.hpp> // OpenCL 1.0, 1.1, 1.2
 
@@ -145,6 +150,7 @@ struct Device_Info {
     uint compute_units=0u; // compute units (CUs) can contain multiple cores depending on the microarchitecture
     uint clock_frequency=0u; // in MHz
     bool is_cpu=false, is_gpu=false;
+    bool is_unified_memory=false; // device shares physical memory with the host (CPUs, integrated GPUs), so buffers can live in host memory
     uint is_fp64_capable=0u, is_fp32_capable=0u, is_fp16_capable=0u, is_int64_capable=0u, is_int32_capable=0u, is_int16_capable=0u, is_int8_capable=0u;
     uint cores=0u; // for CPUs, compute_units is the number of threads (twice the number of cores with hyperthreading)
     float tflops=0.0f; // estimated device FP32 floating point performance in TeraFLOPs/s
@@ -170,6 +176,7 @@ struct Device_Info {
         is_int8_capable = (uint)cl_device.getInfo<CL_DEVICE_NATIVE_VECTOR_WIDTH_CHAR>();
         is_cpu = cl_device.getInfo<CL_DEVICE_TYPE>()==CL_DEVICE_TYPE_CPU;
         is_gpu = cl_device.getInfo<CL_DEVICE_TYPE>()==CL_DEVICE_TYPE_GPU;
+        is_unified_memory = is_cpu||(bool)cl_device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>();
         const uint ipc = is_gpu?2u:32u; // IPC (instructions per cycle) is 2 for GPUs and 32 for most modern CPUs
         const bool nvidia_192_cores_per_cu = contains_any(to_lower(name), {"gt 6", "gt 7", "gtx 6", "gtx 7", "quadro k", "tesla k"}) || (clock_frequency<1000u&&contains(to_lower(name), "titan")); // identify Kepler GPUs
         const bool nvidia_64_cores_per_cu = contains_any(to_lower(name), {"p100", "v100", "a100", "a30", " 16", " 20", "titan v", "titan rtx", "quadro t", "tesla t", "quadro rtx"}) && !contains(to_lower(name), "rtx a"); // identify P100, Volta, Turing, A100, A30
@@ -253,12 +260,35 @@ inline Device_Info select_device_with_id(const uint id, const std::vector<Device
         return devices[0]; // is never executed, just to avoid compiler warnings
     }
 }
+inline Device_Info select_device_with_name(const std::string& name, const std::vector<Device_Info>& devices=get_devices(), const bool print_info=true) { // returns first device whose name contains the specified text, ignoring case
+    for(uint i=0u; i<(uint)devices.size(); i++) {
+        if(contains(to_lower(devices[i].name), to_lower(name))) {
+            if(print_info) print_device_info(devices[i], i);
+            return devices[i];
+        }
+    }
+    print_error("There is no device named \""+name+"\".");
+    return devices[0]; // is never executed, just to avoid compiler warnings
+}
+
+inline std::string& program_cache_directory() { // directory to keep compiled program binaries in, or empty to always compile from source
+    static std::string directory;
+    return directory;
+}
+inline std::string hash_string(const std::string& s) { // 64-bit FNV-1a hash of s as a hex string, stable across runs and platforms
+    ulong h = 14695981039346656037ull;
+    for(uint i=0u; i<(uint)s.length(); i++) h = (h^(uchar)s[i])*1099511628211ull;
+    char buf[17];
+    snprintf(buf, 17, "%016llx", (unsigned long long)h);
+    return std::string(buf);
+}
 
 class Device {
 private:
     cl::Context cl_context;
     cl::Program cl_program;
     cl::CommandQueue cl_queue;
+    cl::CommandQueue cl_transfer_queue;
     bool exists = false;
     inline std::string enable_device_capabilities() const { return // enable FP64/FP16 capabilities if available
         "\n	#define def_workgroup_size "+std::to_string(WORKGROUP_SIZE)+"u"
@@ -272,27 +302,67 @@ private:
         "\n	#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable" // make sure cl_khr_int64_base_atomics extension is enabled
         "\n	#endif"
     ;}
+    inline bool load_program_binary(const std::string& path, const char* options) { // try to create the program from a cached binary, returns false if it is missing or stale
+        std::ifstream file(path, std::ios::in|std::ios::binary);
+        if(!file.is_open()) return false;
+        std::vector<unsigned char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if(binary.empty()) return false;
+        cl_int error = CL_SUCCESS;
+        std::vector<cl_int> status;
+        cl::Program program(cl_context, {info.cl_device}, cl::Program::Binaries {binary}, &status, &error);
+        if(error!=CL_SUCCESS||status.empty()||status[0]!=CL_SUCCESS) return false;
+        if(program.build(options)!=CL_SUCCESS) return false; // the driver rejected the binary, so compile from source again
+        cl_program = program;
+        return true;
+    }
+    inline void save_program_binary(const std::string& path) const { // write the compiled program to the cache; failures only cost a rebuild next time
+        const std::vector<std::vector<unsigned char>> binaries = cl_program.getInfo<CL_PROGRAM_BINARIES>();
+        if(binaries.empty()||binaries[0].empty()) return;
+        const std::string tmp = path+".tmp";
+        {
+            std::ofstream file(tmp, std::ios::out|std::ios::binary);
+            file.write((const char*)binaries[0].data(), binaries[0].size());
+            if(!file.good()) { file.close(); std::remove(tmp.c_str()); return; }
+        }
+        std::remove(path.c_str());
+        if(std::rename(tmp.c_str(), path.c_str())!=0) std::remove(tmp.c_str());
+    }
 public:
     Device_Info info;
+    std::shared_ptr<void> session; // Session with the kernels and buffers kept across frames, created on first use by get_session()
     inline Device(const Device_Info& info, const std::string& opencl_c_code=get_opencl_c_code()) {
         this->info = info;
         cl_context = cl::Context(info.cl_device);
         cl_queue = cl::CommandQueue(cl_context, info.cl_device); // queue to push commands for the device
+        cl_transfer_queue = cl::CommandQueue(cl_context, info.cl_device); // second queue, so copies can run while kernels run on the first one
         cl::Program::Sources cl_source;
         const std::string kernel_code = enable_device_capabilities()+"\n"+opencl_c_code;
+#ifndef LOG
+        const char* build_options = "-cl-fast-relaxed-math -w"; // disable warnings
+#else // LOG
+        const char* build_options = "-cl-fast-relaxed-math";
+#endif // LOG
+        std::string cache_file = ""; // cached binaries are only valid for the same device, driver, options and source
+        if(!program_cache_directory().empty()) cache_file = program_cache_directory()+"/"+hash_string(info.name+"\n"+info.vendor+"\n"+info.driver_version+"\n"+info.opencl_c_version+"\n"+build_options+"\n"+kernel_code)+".bin";
+        if(!cache_file.empty()&&load_program_binary(cache_file, build_options)) {
+            print_info("OpenCL C code loaded from cache.");
+            this->exists = true;
+            return;
+        }
         cl_source.push_back({ kernel_code.c_str(), kernel_code.length() });
         cl_program = cl::Program(cl_context, cl_source);
 #ifndef LOG
-        int error = cl_program.build("-cl-fast-relaxed-math -w"); // compile OpenCL C code, disable warnings
+        int error = cl_program.build(build_options); // compile OpenCL C code
         if(error) print_warning(cl_program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(info.cl_device)); // print build log
 #else // LOG, generate logfile for OpenCL code compilation
-        int error = cl_program.build("-cl-fast-relaxed-math"); // compile OpenCL C code
+        int error = cl_program.build(build_options); // compile OpenCL C code
         const std::string log = cl_program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(info.cl_device);
         write_file("bin/kernel.log", log); // save build log
         if((uint)log.length()>2u) print_warning(log); // print build log
 #endif // LOG
         if(error) print_error("OpenCL C code compilation failed with error code "+std::to_string(error)+". Make sure there are no errors in kernel.cpp.");
         else print_info("OpenCL C code successfully compiled.");
+        if(!cache_file.empty()) save_program_binary(cache_file);
 #ifdef PTX // generate assembly (ptx) file for OpenCL code
         write_file("bin/kernel.ptx", cl_program.getInfo<CL_PROGRAM_BINARIES>()[0]); // save binary (ptx file)
 #endif // PTX
@@ -303,6 +373,7 @@ public:
     inline cl::Context get_cl_context() const { return cl_context; }
     inline cl::Program get_cl_program() const { return cl_program; }
     inline cl::CommandQueue get_cl_queue() const { return cl_queue; }
+    inline cl::CommandQueue get_cl_transfer_queue() const { return cl_transfer_queue; }
     inline bool is_initialized() const { return exists; }
 };
 
@@ -313,6 +384,8 @@ private:
     bool host_buffer_exists = false;
     bool device_buffer_exists = false;
     bool external_host_buffer = false;
+    bool aligned_host_buffer = false; // host buffer was allocated page-aligned
+    bool host_mapped = false; // device buffer uses the host buffer as its storage, so transfers are only map/unmap
     T* host_buffer = nullptr; // host buffer
     cl::Buffer device_buffer; // device buffer
     Device* device = nullptr; // pointer to linked Device
@@ -323,19 +396,34 @@ private:
         if(d>0x2u) z = s2 = host_buffer+N*0x2ull; if(d>0x6u) s6 = host_buffer+N*0x6ull; if(d>0xAu) sA = host_buffer+N*0xAull; if(d>0xEu) sE = host_buffer+N*0xEull;
         if(d>0x3u) w = s3 = host_buffer+N*0x3ull; if(d>0x7u) s7 = host_buffer+N*0x7ull; if(d>0xBu) sB = host_buffer+N*0xBull; if(d>0xFu) sF = host_buffer+N*0xFull;
     }
-    inline void allocate_device_buffer(Device& device, const bool allocate_device) {
+    inline T* new_host_buffer(const Device& device, const ulong n) { // page-aligned on unified memory devices, so the device can use it in place
+        aligned_host_buffer = device.info.is_unified_memory;
+        if(aligned_host_buffer) return (T*)::operator new[](n*sizeof(T), std::align_val_t(4096));
+        return new T[n];
+    }
+    inline void allocate_device_buffer(Device& device, const bool allocate_device, T* const use_host_buffer=nullptr) { // with use_host_buffer, the device buffer is stored in that host memory instead
         this->device = &device;
         this->cl_queue = device.get_cl_queue();
         if(allocate_device) {
             device.info.memory_used += (uint)(capacity()/1048576ull); // track device memory usage
             if(device.info.memory_used>device.info.memory) print_error("Device \""+device.info.name+"\" does not have enough memory. Allocating another "+std::to_string((uint)(capacity()/1048576ull))+" MB would use a total of "+std::to_string(device.info.memory_used)+" MB / "+std::to_string(device.info.memory)+" MB.");
             int error = 0;
-            device_buffer = cl::Buffer(device.get_cl_context(), CL_MEM_READ_WRITE, capacity(), nullptr, &error);
+            host_mapped = use_host_buffer!=nullptr;
+            if(host_mapped) device_buffer = cl::Buffer(device.get_cl_context(), CL_MEM_READ_WRITE|CL_MEM_USE_HOST_PTR, capacity(), (void*)use_host_buffer, &error);
+            else device_buffer = cl::Buffer(device.get_cl_context(), CL_MEM_READ_WRITE, capacity(), nullptr, &error);
             if(error==-61) print_error("Memory size is too large at "+std::to_string((uint)(capacity()/1048576ull))+" MB. Device \""+device.info.name+"\" accepts a maximum buffer size of "+std::to_string(device.info.max_global_buffer)+" MB.");
             else if(error) print_error("Device buffer allocation failed with error code "+std::to_string(error)+".");
             device_buffer_exists = true;
         }
     }
+    inline void sync_host_buffer(const cl_map_flags flags, const ulong offset, const ulong length, const bool blocking) { // for host-mapped buffers, mapping and unmapping is all it takes for either side to see the other's writes
+        int error = CL_SUCCESS; // the map blocks, so it has finished before the unmap; writes map with CL_MAP_WRITE_INVALIDATE_REGION, since CL_MAP_WRITE may copy the device's old contents over what the host just wrote
+        void* mapped = cl_queue.enqueueMapBuffer(device_buffer, CL_TRUE, flags, offset, length, nullptr, nullptr, &error);
+        if(error!=CL_SUCCESS) throw OpenCLException(std::to_string(error));
+        cl::Event unmapped;
+        cl_queue.enqueueUnmapMemObject(device_buffer, mapped, nullptr, &unmapped);
+        if(blocking) unmapped.wait();
+    }
 public:
     T *x=nullptr, *y=nullptr, *z=nullptr, *w=nullptr; // host buffer auxiliary pointers for multi-dimensional array access (array of structures)
     T *s0=nullptr, *s1=nullptr, *s2=nullptr, *s3=nullptr, *s4=nullptr, *s5=nullptr, *s6=nullptr, *s7=nullptr, *s8=nullptr, *s9=nullptr, *sA=nullptr, *sB=nullptr, *sC=nullptr, *sD=nullptr, *sE=nullptr, *sF=nullptr;
@@ -344,13 +432,13 @@ public:
         if(N*(ulong)dimensions==0ull) print_error("Memory size must be larger than 0.");
         this->N = N;
         this->d = dimensions;
-        allocate_device_buffer(device, allocate_device);
         if(allocate_host) {
-            host_buffer = new T[N*(ulong)d];
+            host_buffer = new_host_buffer(device, N*(ulong)d);
             for(ulong i=0ull; i<N*(ulong)d; i++) host_buffer[i] = value;
             initialize_auxiliary_pointers();
             host_buffer_exists = true;
         }
+        allocate_device_buffer(device, allocate_device, allocate_host&&device.info.is_unified_memory ? host_buffer : nullptr);
         //write_to_device();
     }
     inline Memory(Device& device, const ulong N, const uint dimensions, T* const host_buffer, const bool allocate_device=true) {
@@ -358,7 +446,7 @@ public:
         if(N*(ulong)dimensions==0ull) print_error("Memory size must be larger than 0.");
         this->N = N;
         this->d = dimensions;
-        allocate_device_buffer(device, allocate_device);
+        allocate_device_buffer(device, allocate_device, device.info.is_unified_memory ? host_buffer : nullptr);
         this->host_buffer = host_buffer;
         initialize_auxiliary_pointers();
         host_buffer_exists = true;
@@ -379,12 +467,14 @@ public:
             device_buffer = memory.get_cl_buffer(); // transfer device_buffer pointer
             device->info.memory_used += (uint)(capacity()/1048576ull); // track device memory usage
             device_buffer_exists = true;
+            host_mapped = memory.host_mapped;
         }
         if(memory.host_buffer_exists) {
             host_buffer = memory.exchange_host_buffer(nullptr); // transfer host_buffer pointer
             initialize_auxiliary_pointers();
             host_buffer_exists = true;
             external_host_buffer = memory.external_host_buffer;
+            aligned_host_buffer = memory.aligned_host_buffer;
         }
         return *this; // destructor of memory will be called automatically
     }
@@ -395,7 +485,7 @@ public:
     }
     inline void add_host_buffer() { // makes only sense if there is no host buffer yet but an existing device buffer
         if(!host_buffer_exists&&device_buffer_exists) {
-            host_buffer = new T[N*(ulong)d];
+            host_buffer = new_host_buffer(*device, N*(ulong)d);
             initialize_auxiliary_pointers();
             read_from_device();
             host_buffer_exists = true;
@@ -406,7 +496,7 @@ public:
     }
     inline void add_device_buffer() { // makes only sense if there is no device buffer yet but an existing host buffer
         if(!device_buffer_exists&&host_buffer_exists) {
-            allocate_device_buffer(*device, true);
+            allocate_device_buffer(*device, true, device->info.is_unified_memory ? host_buffer : nullptr);
             write_to_device();
         } else if(!host_buffer_exists) {
             print_error("There is no existing host buffer, so can't add device buffer.");
@@ -414,7 +504,10 @@ public:
     }
     inline void delete_host_buffer() {
         host_buffer_exists = false;
-        if(!external_host_buffer) delete[] host_buffer;
+        if(!external_host_buffer) {
+            if(aligned_host_buffer) ::operator delete[](host_buffer, std::align_val_t(4096));
+            else delete[] host_buffer;
+        }
         if(!device_buffer_exists) {
             N = 0ull;
             d = 1u;
@@ -423,6 +516,7 @@ public:
     inline void delete_device_buffer() {
         if(device_buffer_exists) device->info.memory_used -= (uint)(capacity()/1048576ull); // track device memory usage
         device_buffer_exists = false;
+        host_mapped = false;
         device_buffer = nullptr;
         if(!host_buffer_exists) {
             N = 0ull;
@@ -450,24 +544,28 @@ public:
     inline const T operator()(const ulong i) const { return host_buffer[i]; }
     inline const T operator()(const ulong i, const uint dimension) const { return host_buffer[i+(ulong)dimension*N]; } // array of structures
     inline void read_from_device(const bool blocking=true) {
-        if(host_buffer_exists&&device_buffer_exists) {
+        if(host_buffer_exists&&device_buffer_exists&&host_mapped) sync_host_buffer(CL_MAP_READ, 0u, capacity(), blocking);
+        else if(host_buffer_exists&&device_buffer_exists) {
             int res = cl_queue.enqueueReadBuffer(device_buffer, blocking, 0u, capacity(), (void*)host_buffer);
             if (res != CL_SUCCESS) throw OpenCLException(std::to_string(res));
         }
     }
     inline void write_to_device(const bool blocking=true) {
-        if(host_buffer_exists&&device_buffer_exists) cl_queue.enqueueWriteBuffer(device_buffer, blocking, 0u, capacity(), (void*)host_buffer);
+        if(host_buffer_exists&&device_buffer_exists&&host_mapped) sync_host_buffer(CL_MAP_WRITE_INVALIDATE_REGION, 0u, capacity(), blocking);
+        else if(host_buffer_exists&&device_buffer_exists) cl_queue.enqueueWriteBuffer(device_buffer, blocking, 0u, capacity(), (void*)host_buffer);
     }
     inline void read_from_device(const ulong offset, const ulong length, const bool blocking=true) {
         if(host_buffer_exists&&device_buffer_exists) {
             const ulong safe_offset=min(offset, range()), safe_length=min(length, range()-safe_offset);
-            if(safe_length>0ull) cl_queue.enqueueReadBuffer(device_buffer, blocking, safe_offset*sizeof(T), safe_length*sizeof(T), (void*)(host_buffer+safe_offset));
+            if(safe_length>0ull&&host_mapped) sync_host_buffer(CL_MAP_READ, safe_offset*sizeof(T), safe_length*sizeof(T), blocking);
+            else if(safe_length>0ull) cl_queue.enqueueReadBuffer(device_buffer, blocking, safe_offset*sizeof(T), safe_length*sizeof(T), (void*)(host_buffer+safe_offset));
         }
     }
     inline void write_to_device(const ulong offset, const ulong length, const bool blocking=true) {
         if(host_buffer_exists&&device_buffer_exists) {
             const ulong safe_offset=min(offset, range()), safe_length=min(length, range()-safe_offset);
-            if(safe_length>0ull) cl_queue.enqueueWriteBuffer(device_buffer, blocking, safe_offset*sizeof(T), safe_length*sizeof(T), (void*)(host_buffer+safe_offset));
+            if(safe_length>0ull&&host_mapped) sync_host_buffer(CL_MAP_WRITE_INVALIDATE_REGION, safe_offset*sizeof(T), safe_length*sizeof(T), blocking);
+            else if(safe_length>0ull) cl_queue.enqueueWriteBuffer(device_buffer, blocking, safe_offset*sizeof(T), safe_length*sizeof(T), (void*)(host_buffer+safe_offset));
         }
     }
     inline void read_from_device_1d(const ulong x0, const ulong x1, const int dimension=-1, const bool blocking=true) { // read 1D domain from device, either for all std::vector dimensions (-1) or for a specified dimension
@@ -550,6 +648,16 @@ public:
     inline void enqueue_write_to_device() { write_to_device(false); }
     inline void enqueue_read_from_device(const ulong offset, const ulong length) { read_from_device(offset, length, false); }
     inline void enqueue_write_to_device(const ulong offset, const ulong length) { write_to_device(offset, length, false); }
+    inline void enqueue_transfer_to_device() { // write on the transfer queue, so the copy overlaps kernels that are already queued; commands queued afterwards wait for it, but the buffer must not be in use by earlier ones
+        if(host_mapped) write_to_device(false); // nothing is copied, so there is nothing to overlap
+        else if(host_buffer_exists&&device_buffer_exists) {
+            cl::CommandQueue cl_transfer_queue = device->get_cl_transfer_queue();
+            std::vector<cl::Event> written(1);
+            cl_transfer_queue.enqueueWriteBuffer(device_buffer, false, 0u, capacity(), (void*)host_buffer, nullptr, &written[0]);
+            cl_transfer_queue.flush();
+            cl_queue.enqueueBarrierWithWaitList(&written);
+        }
+    }
     inline void finish_queue() { cl_queue.finish(); }
     inline const cl::Buffer& get_cl_buffer() const { return device_buffer; }
 };
@@ -643,6 +751,37 @@ public:
     }
 };
 
+class Session { // kernels and scratch buffers of a device that are kept across frames, so they are only created once per size; not thread-safe
+private:
+    Device& device;
+    std::unordered_map<std::string, Kernel> kernels;
+    std::unordered_map<std::string, std::shared_ptr<void>> buffers;
+public:
+    std::unordered_map<std::string, bool> checks; // results of runtime self-checks of kernels, by name; a missing entry means the check has not passed
+    inline Session(Device& device): device(device) {}
+    template<class... T> inline Kernel& kernel(const std::string& name, const ulong N, const T&... parameters) { // returns the kernel with the specified parameters and range; arguments are captured when it is enqueued, so it can be re-enqueued with new ones right away
+        auto it = kernels.find(name);
+        if(it==kernels.end()) it = kernels.emplace(name, Kernel(device, N, name)).first;
+        it->second.set_parameters(0u, parameters...).set_ranges(N);
+        return it->second;
+    }
+    template<typename T> inline Memory<T>& buffer(const std::string& name, const ulong N, const uint dimensions=1u, const bool allocate_host=true) { // returns a scratch buffer, which is only reallocated when its size changes
+        auto it = buffers.find(name);
+        if(it!=buffers.end()) {
+            Memory<T>* memory = (Memory<T>*)it->second.get();
+            if(memory->length()==N&&memory->dimensions()==dimensions) return *memory;
+        }
+        std::shared_ptr<Memory<T>> memory = std::make_shared<Memory<T>>(device, N, dimensions, allocate_host, true);
+        buffers[name] = memory;
+        return *memory;
+    }
+};
+
+inline Session& get_session(Device& device) {
+    if(!device.session) device.session = std::make_shared<Session>(device);
+    return *(Session*)device.session.get();
+}
+
 }
 
 #endif
@@ -21,26 +21,17 @@
 
 #include "sanjuuni.hpp"
 #include <algorithm>
-#include <list>
-
-#define ALLOWB (2+4+8)
+#include <chrono>
+#include <thread>
 
 extern void toLab(const uchar * image, uchar * output, ulong size);
 
-#define PARALLEL_BITONIC_B2_KERNEL "ParallelBitonic_B2"
-#define PARALLEL_BITONIC_B4_KERNEL "ParallelBitonic_B4"
-#define PARALLEL_BITONIC_B8_KERNEL "ParallelBitonic_B8"
-#define PARALLEL_BITONIC_B16_KERNEL "ParallelBitonic_B16"
-#define PARALLEL_BITONIC_C2_KERNEL "ParallelBitonic_C2"
-#define PARALLEL_BITONIC_C4_KERNEL "ParallelBitonic_C4"
-
 Mat makeLabImage(Mat& image, OpenCL::Device * device) {
     Mat retval(image.width, image.height, device);
 #ifdef HAS_OPENCL
     if (device != NULL) {
         image.upload();
-        OpenCL::Kernel kernel(*device, image.width * image.height, "toLab", *image.mem, *retval.mem, (ulong)(image.width * image.height));
-        kernel.run();
+        OpenCL::get_session(*device).kernel("toLab", image.width * image.height, *image.mem, *retval.mem, (ulong)(image.width * image.height)).enqueue_run();
         retval.onHost = false;
         retval.onDevice = true;
     } else {
@@ -49,7 +40,7 @@ Mat makeLabImage(Mat& image, OpenCL::Device * device) {
         retval.onDevice = false;
         for (int y = 0; y < image.height; y++) {
             for (int x = 0; x < image.width; x++) {
-                toLab((uchar*)(image.vec.data() + y * image.width + x), (uchar*)(retval.vec.data() + y * image.width + x), image.width * image.height);
+                toLab((uchar*)&image.at(y, x), (uchar*)&retval.at(y, x), image.width * image.height);
             }
         }
 #ifdef HAS_OPENCL
@@ -143,110 +134,30 @@ static void medianCut(std::vector<Vec3b>& pal, int num, int lastComponent, std::
 }
 
 #ifdef HAS_OPENCL
-static void medianCutGPUQueue(
-    OpenCL::Device& device,
-    OpenCL::Memory<uchar>& buffer,
-    OpenCL::Memory<uchar>& components,
-    OpenCL::Memory<uchar>& result,
-    ulong length, ulong offset, uchar n, int numColors
-) {
-    ulong nparts = length / 128 + (length % 128 ? 1 : 0);
-    if (n >= numColors) {
-        // Average the buckets
-        OpenCL::Memory<uint> temp(device, nparts, 3, false, true);
-        OpenCL::Kernel avgA(device, nparts, "averageKernel_A", buffer, temp, offset, length);
-        OpenCL::Kernel avgB(device, 1, 1, "averageKernel_B", temp, result, (ulong)(n - numColors), length);
-        result.enqueue_read_from_device(); // VERY IMPORTANT LINE, IT BREAKS WITHOUT THIS
-        avgA.enqueue_run();
-        avgB.enqueue_run();
-        return;
+// Enqueues a median cut of the image, returning the device buffer that the palette will be written to
+// Each level of splits takes three launches over histograms of the boxes, so no sorting or host syncs are needed
+static OpenCL::Memory<uchar>& medianCutGPU(Mat& image, int numColors, OpenCL::Device& device) {
+    image.upload();
+    ulong size = image.width * image.height;
+    OpenCL::Session& session = OpenCL::get_session(device);
+    OpenCL::Memory<ushort>& nodes = session.buffer<ushort>("medianCut.nodes", size, 1, false);
+    OpenCL::Memory<uint>& stats = session.buffer<uint>("medianCut.stats", numColors, 6, false);
+    OpenCL::Memory<uint>& splits = session.buffer<uint>("medianCut.splits", numColors, 2, false);
+    OpenCL::Memory<uint>& sums = session.buffer<uint>("medianCut.sums", numColors, 4, false);
+    OpenCL::Memory<uint>& histogram = session.buffer<uint>("medianCut.histogram", std::max(numColors / 2, 1), 256, false);
+    OpenCL::Memory<uchar>& pal = session.buffer<uchar>("medianCut.palette", numColors, 3);
+    device.get_cl_queue().enqueueFillBuffer<uint>(stats.get_cl_buffer(), 0, 0, numColors * 6 * sizeof(uint));
+    device.get_cl_queue().enqueueFillBuffer<uint>(splits.get_cl_buffer(), 0xFFFFFFFF, 0, numColors * 2 * sizeof(uint)); // the root has no last component
+    device.get_cl_queue().enqueueFillBuffer<uint>(sums.get_cl_buffer(), 0, 0, numColors * 4 * sizeof(uint));
+    session.kernel("medianCutAssign", size, *image.mem, nodes, splits, stats, sums, size, (uint)numColors, (uint)0, OpenCL::LocalMemory<uint>(numColors * 6)).enqueue_run();
+    for (uint level = 0; (1 << level) < numColors; level++) {
+        device.get_cl_queue().enqueueFillBuffer<uint>(histogram.get_cl_buffer(), 0, 0, (1 << level) * 256 * sizeof(uint));
+        session.kernel("medianCutHistogram", size, *image.mem, nodes, stats, splits, histogram, size, level).enqueue_run();
+        session.kernel("medianCutSplit", (1 << level) * WORKGROUP_SIZE, stats, splits, histogram, level, OpenCL::LocalMemory<uint>(WORKGROUP_SIZE)).enqueue_run();
+        session.kernel("medianCutAssign", size, *image.mem, nodes, splits, stats, sums, size, (uint)numColors, level + 1, OpenCL::LocalMemory<uint>(numColors * 6)).enqueue_run();
     }
-    // Find maximum range
-    OpenCL::Memory<uchar> intranges_mem(device, nparts, 6, false, true);
-    OpenCL::Kernel rangeA(device, nparts, "calculateRange_A", buffer, intranges_mem, length, offset);
-    OpenCL::Kernel rangeB(device, 1, 1, "calculateRange_B", intranges_mem, components, nparts, n);
-    rangeA.enqueue_run();
-    rangeB.enqueue_run();
-    // Sort entries
-    // Adapted from http://www.bealto.com/gpu-sorting_parallel-bitonic-2.html
-    for (size_t length_ = 1; length_ < length; length_ <<= 1) {
-        long inc = length_;
-        std::list<int> strategy; // vector defining the sequence of reductions
-        {
-            int ii = inc;
-            while (ii > 0) {
-                if (ii == 128 || ii == 32 || ii == 8) {
-                    strategy.push_back(-1);
-                    break;
-                }          // C kernel
-                int d = 1; // default is 1 bit
-                if (0) d = 1;
-                // Force jump to 128
-                else if (ii == 256) d = 1;
-                else if (ii == 512 && (ALLOWB & 4)) d = 2;
-                else if (ii == 1024 && (ALLOWB & 8)) d = 3;
-                else if (ii == 2048 && (ALLOWB & 16)) d = 4;
-                else if (ii >= 8 && (ALLOWB & 16)) d = 4;
-                else if (ii >= 4 && (ALLOWB & 8)) d = 3;
-                else if (ii >= 2 && (ALLOWB & 4)) d = 2;
-                else d = 1;
-                strategy.push_back(d);
-                ii >>= d;
-            }
-        }
-
-        while (inc > 0) {
-            int ninc = 0;
-            std::string kid;
-            int doLocal = 0;
-            int nThreads = 0;
-            int d = strategy.front();
-            strategy.pop_front();
-
-            switch (d) {
-            case -1:
-                kid = PARALLEL_BITONIC_C4_KERNEL;
-                ninc = -1; // reduce all bits
-                doLocal = 4;
-                nThreads = length >> 2;
-                break;
-            case 4:
-                kid = PARALLEL_BITONIC_B16_KERNEL;
-                ninc = 4;
-                nThreads = length >> ninc;
-                break;
-            case 3:
-                kid = PARALLEL_BITONIC_B8_KERNEL;
-                ninc = 3;
-                nThreads = length >> ninc;
-                break;
-            case 2:
-                kid = PARALLEL_BITONIC_B4_KERNEL;
-                ninc = 2;
-                nThreads = length >> ninc;
-                break;
-            case 1:
-                kid = PARALLEL_BITONIC_B2_KERNEL;
-                ninc = 1;
-                nThreads = length >> ninc;
-                break;
-            default: printf("Strategy error!\n"); break;
-            }
-            OpenCL::Kernel kern(device, nThreads, kid, buffer, (int)inc, (int)(length_ << 1), components, n, offset);
-            int wg = kern.get_max_workgroup_size(device);
-            wg = std::min(wg, 256);
-            wg = std::min(wg, nThreads);
-            kern.set_ranges(nThreads, wg);
-            if (doLocal > 0) kern.add_parameters(OpenCL::LocalMemory<uchar>(doLocal * wg * 3));
-            kern.enqueue_run();
-            device.get_cl_queue().enqueueBarrierWithWaitList();
-            if (ninc < 0) break; // done
-            inc >>= ninc;
-        }
-    }
-    // Recurse
-    medianCutGPUQueue(device, buffer, components, result, length / 2, offset, n << 1, numColors);
-    medianCutGPUQueue(device, buffer, components, result, length / 2, offset + length / 2, (n << 1) | 1, numColors);
+    session.kernel("medianCutAverage", numColors, sums, pal, (uint)numColors).enqueue_run();
+    return pal;
 }
 #endif
 
@@ -256,25 +167,7 @@ std::vector<Vec3b> reducePalette_medianCut(Mat& image, int numColors, OpenCL::De
     std::vector<Vec3b> newpal(numColors);
 #ifdef HAS_OPENCL
     if (device != NULL) {
-        image.upload();
-        size_t sz = image.width * image.height;
-        bool diffuse = false;
-        if (sz & (sz - 1)) {
-            diffuse = true;
-            sz = 1 << ((int)log2(sz) + 1);
-        }
-        OpenCL::Memory<uchar> buffer(*device, sz, 3, false, true);
-        OpenCL::Memory<uchar> components(*device, numColors, 3, false, true);
-        OpenCL::Memory<uchar> pal(*device, numColors, 3);
-        device->get_cl_queue().enqueueFillBuffer<uchar>(components.get_cl_buffer(), 255, 0, 1);
-        device->get_cl_queue().enqueueCopyBuffer(image.mem->get_cl_buffer(), buffer.get_cl_buffer(), 0, 0, image.width * image.height * 3);
-        if (diffuse) {
-            float step = (float)sz / (image.width * image.height);
-            OpenCL::Kernel copy(*device, sz - (image.width * image.height), "diffuseKernel", buffer, (ulong)(image.width * image.height), (ulong)sz, step);
-            copy.enqueue_run();
-        }
-        device->get_cl_queue().enqueueBarrierWithWaitList();
-        medianCutGPUQueue(*device, buffer, components, pal, sz, 0, 1, numColors);
+        OpenCL::Memory<uchar>& pal = medianCutGPU(image, numColors, *device);
         pal.enqueue_read_from_device();
         device->finish_queue();
         for (int i = 0; i < numColors; i++) newpal[i] = {pal[i*3], pal[i*3+1], pal[i*3+2]};
@@ -370,32 +263,29 @@ std::vector<Vec3b> reducePalette_kMeans(Mat& image, int numColors, OpenCL::Devic
     std::vector<Vec3b> newpal(numColors);
 #ifdef HAS_OPENCL
     if (device != NULL) {
-        ulong nparts = (image.width * image.height) / 128 + ((image.width * image.height) % 128 ? 1 : 0);
-        std::vector<Vec3b> basepal = reducePalette_medianCut(image, 16, device);
-        OpenCL::Memory<uchar> palette(*device, numColors, 3);
-        OpenCL::Memory<uchar> buckets(*device, image.width * image.height, 1, false, true);
-        OpenCL::Memory<uint> avgbuf(*device, nparts * numColors, 4, false, true);
-        OpenCL::Memory<uchar> changed(*device, 1, 1);
-        OpenCL::Kernel bucket(*device, image.width * image.height, "kMeans_bucket_kernel", *image.mem, buckets, palette, (ulong)numColors);
-        OpenCL::Kernel recenterA(*device, nparts * numColors, numColors, "kMeans_recenter_kernel_A", *image.mem, buckets, avgbuf, (ulong)(image.width * image.height), OpenCL::LocalMemory<uchar>(128));
-        OpenCL::Kernel recenterB(*device, numColors, numColors, "kMeans_recenter_kernel_B", avgbuf, palette, nparts, changed);
-        image.upload();
-        for (int i = 0; i < numColors; i++) {
-            palette[i*3] = basepal[i][0];
-            palette[i*3+1] = basepal[i][1];
-            palette[i*3+2] = basepal[i][2];
+        ulong size = image.width * image.height;
+        OpenCL::Session& session = OpenCL::get_session(*device);
+        OpenCL::Memory<uchar>& palette = session.buffer<uchar>("kMeans.palette", numColors, 3);
+        OpenCL::Memory<uint>& sums = session.buffer<uint>("kMeans.sums", numColors, 4, false);
+        OpenCL::Memory<uint>& state = session.buffer<uint>("kMeans.state", 1, 1);
+        // start from the median cut palette without bringing it back to the host; median cut only splits into powers of two, so
+        // like the CPU path it always makes 16 colors, arranges them the same way, and keeps the first numColors
+        OpenCL::Memory<uchar>& seed = medianCutGPU(image, 16, *device);
+        session.kernel("arrangePalette", 1, seed, (uchar)16).set_ranges(1, 1).enqueue_run();
+        device->get_cl_queue().enqueueCopyBuffer(seed.get_cl_buffer(), palette.get_cl_buffer(), 0, 0, numColors * 3);
+        device->get_cl_queue().enqueueFillBuffer<uint>(sums.get_cl_buffer(), 0, 0, numColors * 4 * sizeof(uint));
+        device->get_cl_queue().enqueueFillBuffer<uint>(state.get_cl_buffer(), 0, 0, sizeof(uint));
+        OpenCL::Kernel& assign = session.kernel("kMeans_assign_kernel", size, *image.mem, palette, sums, state, size, (uint)numColors, OpenCL::LocalMemory<uint>(numColors * 4));
+        OpenCL::Kernel& update = session.kernel("kMeans_update_kernel", numColors, sums, palette, state, OpenCL::LocalMemory<uint>(1)).set_ranges(numColors, numColors);
+        // iterations after convergence do nothing, so only check for it every few iterations
+        for (int loop = 0; loop < 100; loop += 10) {
+            for (int i = 0; i < 10; i++) {
+                assign.enqueue_run();
+                update.enqueue_run();
+            }
+            state.read_from_device();
+            if (state[0]) break;
         }
-        palette.enqueue_write_to_device();
-        int loop = 0;
-        do {
-            changed[0] = 0;
-            changed.enqueue_write_to_device();
-            bucket.enqueue_run();
-            recenterA.enqueue_run();
-            recenterB.enqueue_run();
-            changed.enqueue_read_from_device();
-            device->finish_queue();
-        } while (changed[0] && loop++ < 100);
         palette.read_from_device();
         for (int i = 0; i < numColors; i++) newpal[i] = {palette[i*3], palette[i*3+1], palette[i*3+2]};
     } else {
@@ -529,11 +419,12 @@ Mat thresholdImage(Mat& image, const std::vector<Vec3b>& palette, OpenCL::Device
     if (device != NULL) {
         uchar pal[48];
         for (int i = 0; i < palette.size(); i++) {pal[i*3] = palette[i][0]; pal[i*3+1] = palette[i][1]; pal[i*3+2] = palette[i][2];}
-        OpenCL::Memory<uchar> palette_mem(*device, 48, 1, pal);
-        palette_mem.write_to_device();
+        OpenCL::Session& session = OpenCL::get_session(*device);
+        OpenCL::Memory<uchar>& palette_mem = session.buffer<uchar>("threshold.palette", 48, 1);
+        std::copy(pal, pal + 48, palette_mem.data());
+        palette_mem.enqueue_write_to_device();
         image.upload();
-        OpenCL::Kernel kernel(*device, image.width * image.height, "thresholdKernel", *image.mem, *output.mem, palette_mem, (uchar)palette.size());
-        kernel.run();
+        session.kernel("thresholdKernel", image.width * image.height, *image.mem, *output.mem, palette_mem, (uchar)palette.size(), (ulong)(image.width * image.height)).enqueue_run();
         output.onHost = false;
         output.onDevice = true;
     } else {
@@ -549,32 +440,87 @@ Mat thresholdImage(Mat& image, const std::vector<Vec3b>& palette, OpenCL::Device
     return output;
 }
 
+#ifdef HAS_OPENCL
+// Enqueues Floyd-Steinberg dithering of an image that is already on the device
+template<typename I, typename O>
+static void floydSteinbergGPU(OpenCL::Device& device, OpenCL::Memory<I>& image, OpenCL::Memory<O>& output, OpenCL::Memory<uchar>& palette, uchar paletteSize, ulong width, ulong height) {
+    OpenCL::Session& session = OpenCL::get_session(device);
+    // CPU drivers run the work items of a workgroup in turn, so rows waiting on each other in one workgroup would never finish
+    const ulong workgroupSize = device.info.is_cpu ? 1 : WORKGROUP_SIZE;
+    const ulong workgroups = (height + workgroupSize - 1) / workgroupSize;
+    OpenCL::Memory<float>& error = session.buffer<float>("dither.error", width * (height + 1) * 3, 1, false);
+    OpenCL::Memory<uint>& workgroup_rider = session.buffer<uint>("dither.rider", 1, 1, false);
+    OpenCL::Memory<uint>& workgroup_progress = session.buffer<uint>("dither.progress", workgroups, 1, false);
+    device.get_cl_queue().enqueueFillBuffer<float>(error.get_cl_buffer(), 0.0f, 0, width * (height + 1) * 3 * sizeof(float));
+    device.get_cl_queue().enqueueFillBuffer<uint>(workgroup_rider.get_cl_buffer(), 0u, 0, sizeof(uint));
+    device.get_cl_queue().enqueueFillBuffer<uint>(workgroup_progress.get_cl_buffer(), 0u, 0, workgroups * sizeof(uint));
+    session.kernel("floydSteinbergDither", workgroups * workgroupSize,
+        image, output, palette, paletteSize, error, workgroup_rider, workgroup_progress,
+        OpenCL::LocalMemory<uint>(workgroupSize), width, height).set_ranges(workgroups * workgroupSize, workgroupSize).enqueue_run();
+}
+#endif
+
+int checkDitherDevice(OpenCL::Device * device) {
+#ifdef HAS_OPENCL
+    if (device == NULL) return 0;
+    // Gradients with some noise, so that every row carries error into the next one
+    const int width = 96, height = 80;
+    const std::vector<Vec3b> palette = {{0, 0, 0}, {255, 255, 255}, {255, 0, 0}, {0, 255, 0}, {0, 0, 255}, {255, 255, 0}, {128, 128, 128}, {0, 128, 255}};
+    Mat image(width, height, device);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            image.at(y, x) = {(uchar)(x * 255 / (width - 1)), (uchar)(y * 255 / (height - 1)), (uchar)((x * 37 + y * 91) % 256)};
+    Mat expected = ditherImage(image, palette, NULL);
+    Mat actual(width, height, device);
+    OpenCL::Session& session = OpenCL::get_session(*device);
+    session.checks["floydSteinberg"] = false;
+    OpenCL::Memory<uchar>& palette_mem = session.buffer<uchar>("dither.palette", 48, 1);
+    for (int i = 0; i < palette.size(); i++) {palette_mem[i*3] = palette[i][0]; palette_mem[i*3+1] = palette[i][1]; palette_mem[i*3+2] = palette[i][2];}
+    palette_mem.enqueue_write_to_device();
+    image.upload();
+    floydSteinbergGPU(*device, *image.mem, *actual.mem, palette_mem, (uchar)palette.size(), width, height);
+    // If workgroups can't run alongside each other, the kernel never finishes; don't wait on it forever
+    cl::Event done;
+    device->get_cl_queue().enqueueMarkerWithWaitList(NULL, &done);
+    device->get_cl_queue().flush();
+    for (int i = 0; done.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE; i++) {
+        if (i >= 5000) return -1;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    actual.onHost = false;
+    actual.onDevice = true;
+    actual.download();
+    // The device works in single precision, so single pixels may differ; the average color of each block must not
+    for (int by = 0; by < height; by += 8) {
+        for (int bx = 0; bx < width; bx += 8) {
+            int diff[3] = {0, 0, 0};
+            for (int y = by; y < by + 8; y++) {
+                for (int x = bx; x < bx + 8; x++) {
+                    Vec3b e = expected.at(y, x), a = actual.at(y, x);
+                    if (std::find(palette.begin(), palette.end(), a) == palette.end()) return 0;
+                    for (int c = 0; c < 3; c++) diff[c] += (int)a[c] - (int)e[c];
+                }
+            }
+            for (int c = 0; c < 3; c++) if (abs(diff[c]) > 16 * 64) return 0;
+        }
+    }
+    session.checks["floydSteinberg"] = true;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
 Mat ditherImage(Mat& image, const std::vector<Vec3b>& palette, OpenCL::Device * device) {
     Mat retval(image.width, image.height, device);
 #ifdef HAS_OPENCL
-    if (device != NULL && false) {
-        ulong progress_size = image.height / WORKGROUP_SIZE + (image.height % WORKGROUP_SIZE ? 1 : 0);
-        OpenCL::Memory<uchar> palette_mem(*device, palette.size(), 3);
+    if (device != NULL && OpenCL::get_session(*device).checks["floydSteinberg"]) {
+        OpenCL::Session& session = OpenCL::get_session(*device);
+        OpenCL::Memory<uchar>& palette_mem = session.buffer<uchar>("dither.palette", 48, 1);
         for (int i = 0; i < palette.size(); i++) {palette_mem[i*3] = palette[i][0]; palette_mem[i*3+1] = palette[i][1]; palette_mem[i*3+2] = palette[i][2];}
-        OpenCL::Memory<float> error(*device, image.width * (image.height + 1) * 3, 1, false, true);
-        OpenCL::Memory<uint> workgroup_rider(*device, 1, 1, false, true);
-        OpenCL::Memory<uint> workgroup_progress(*device, progress_size, 1, false, true);
-        OpenCL::LocalMemory<uint> progress(WORKGROUP_SIZE);
-        device->get_cl_queue().enqueueFillBuffer<float>(error.get_cl_buffer(), 0.0f, 0, image.width * (image.height + 1) * 3 * sizeof(float));
         palette_mem.enqueue_write_to_device();
         image.upload();
-        OpenCL::Kernel kernel(
-            *device, image.height, "floydSteinbergDither",
-            *image.mem,
-            *retval.mem,
-            palette_mem,
-            (uchar)palette.size(),
-            error,
-            workgroup_rider,
-            workgroup_progress,
-            progress,
-            (ulong)image.width, (ulong)image.height);
-        kernel.run();
+        floydSteinbergGPU(*device, *image.mem, *retval.mem, palette_mem, (uchar)palette.size(), image.width, image.height);
         retval.onHost = false;
         retval.onDevice = true;
     } else {
@@ -631,11 +577,12 @@ Mat ditherImage_ordered(Mat& image, const std::vector<Vec3b>& palette, OpenCL::D
     if (device != NULL) {
         uchar pal[48];
         for (int i = 0; i < palette.size(); i++) {pal[i*3] = palette[i][0]; pal[i*3+1] = palette[i][1]; pal[i*3+2] = palette[i][2];}
-        OpenCL::Memory<uchar> palette_mem(*device, 48, 1, pal);
-        palette_mem.write_to_device();
+        OpenCL::Session& session = OpenCL::get_session(*device);
+        OpenCL::Memory<uchar>& palette_mem = session.buffer<uchar>("orderedDither.palette", 48, 1);
+        std::copy(pal, pal + 48, palette_mem.data());
+        palette_mem.enqueue_write_to_device();
         image.upload();
-        OpenCL::Kernel kernel(*device, image.width * image.height, "orderedDither", *image.mem, *retval.mem, palette_mem, (uchar)palette.size(), (ulong)image.width, distance);
-        kernel.run();
+        session.kernel("orderedDither", image.width * image.height, *image.mem, *retval.mem, palette_mem, (uchar)palette.size(), (ulong)image.width, distance).enqueue_run();
         retval.onHost = false;
         retval.onDevice = true;
     } else {
@@ -661,11 +608,12 @@ Mat1b rgbToPaletteImage(Mat& image, const std::vector<Vec3b>& palette, OpenCL::D
     if (device != NULL) {
         uchar pal[48];
         for (int i = 0; i < palette.size(); i++) {pal[i*3] = palette[i][0]; pal[i*3+1] = palette[i][1]; pal[i*3+2] = palette[i][2];}
-        OpenCL::Memory<uchar> palette_mem(*device, 48, 1, pal);
-        palette_mem.write_to_device();
+        OpenCL::Session& session = OpenCL::get_session(*device);
+        OpenCL::Memory<uchar>& palette_mem = session.buffer<uchar>("rgbToPalette.palette", 48, 1);
+        std::copy(pal, pal + 48, palette_mem.data());
+        palette_mem.enqueue_write_to_device();
         image.upload();
-        OpenCL::Kernel kernel(*device, image.width * image.height, "rgbToPaletteKernel", *image.mem, *output.mem, palette_mem, (uchar)palette.size(), (ulong)(image.width * image.height));
-        kernel.run();
+        session.kernel("rgbToPaletteKernel", image.width * image.height, *image.mem, *output.mem, palette_mem, (uchar)palette.size(), (ulong)(image.width * image.height)).enqueue_run();
         output.onHost = false;
         output.onDevice = true;
     } else {
@@ -680,3 +628,71 @@ Mat1b rgbToPaletteImage(Mat& image, const std::vector<Vec3b>& palette, OpenCL::D
 #endif
     return output;
 }
+
+bool startConvertImage_device(Mat& image, bool lab, bool dither, bool nfp, int slot, DeviceConversion& conversion, OpenCL::Device * device) {
+#ifdef HAS_OPENCL
+    if (device == NULL || (dither && !OpenCL::get_session(*device).checks["floydSteinberg"])) return false;
+    const int width = image.width - image.width % 2, height = image.height - image.height % 3;
+    const size_t size = (height / 3) * (width / 2);
+    const std::string suffix = "." + std::to_string(slot);
+    OpenCL::Session& session = OpenCL::get_session(*device);
+    OpenCL::Memory<uchar>& pal = medianCutGPU(image, 16, *device);
+    session.kernel("arrangePalette", 1, pal, (uchar)16).set_ranges(1, 1).enqueue_run();
+    OpenCL::Memory<uchar>& reduced = session.buffer<uchar>("pipeline.reduced", image.width * image.height, 3, false);
+    OpenCL::Memory<uchar>& indexed = session.buffer<uchar>("pipeline.indexed", image.width * image.height, 1, false);
+    OpenCL::Memory<uchar>& colors = session.buffer<uchar>("ccImage.colors", height * width / 6, 6, false);
+    // Only the results are still being read once the next image's kernels start, so only they need a buffer per slot
+    OpenCL::Memory<uchar>& chars_mem = session.buffer<uchar>("pipeline.chars" + suffix, size, 1, false);
+    OpenCL::Memory<uchar>& cols_mem = session.buffer<uchar>("pipeline.cols" + suffix, size, 1, false);
+    OpenCL::Memory<uchar>& pal_mem = session.buffer<uchar>("pipeline.result" + suffix, 16, 3, false);
+    if (dither) floydSteinbergGPU(*device, *image.mem, reduced, pal, (uchar)16, image.width, image.height);
+    else session.kernel("thresholdKernel", image.width * image.height, *image.mem, reduced, pal, (uchar)16, (ulong)(image.width * image.height)).enqueue_run();
+    session.kernel("rgbToPaletteKernel", image.width * image.height, reduced, indexed, pal, (uchar)16, (ulong)(image.width * image.height)).enqueue_run();
+    session.kernel("copyColors", height * width / 2, indexed, colors, (ulong)width, (ulong)height).enqueue_run();
+    if (nfp) session.kernel("toNFPPixel", height * width / 6, colors, cols_mem, (ulong)(width * height)).enqueue_run();
+    else {
+        // Character selection compares brightness, so it needs the palette in RGB
+        OpenCL::Memory<uchar>* rgbpal = &pal;
+        if (lab) {
+            rgbpal = &session.buffer<uchar>("pipeline.palette", 16, 3, false);
+            session.kernel("labPaletteToRGB", 16, pal, *rgbpal, (uchar)16).set_ranges(16, 16).enqueue_run();
+        }
+        session.kernel("toCCPixel", height * width / 6, colors, chars_mem, cols_mem, *rgbpal, (ulong)(width * height)).enqueue_run();
+    }
+    device->get_cl_queue().enqueueCopyBuffer(pal.get_cl_buffer(), pal_mem.get_cl_buffer(), 0, 0, 48);
+    // Everything is read back at once on the transfer queue, which only waits for this image's kernels
+    std::vector<cl::Event> computed(1);
+    device->get_cl_queue().enqueueMarkerWithWaitList(NULL, &computed[0]);
+    device->get_cl_queue().flush();
+    cl::CommandQueue transfer = device->get_cl_transfer_queue();
+    conversion.lab = lab;
+    conversion.chars = nfp ? NULL : new uchar[size];
+    conversion.cols = new uchar[size];
+    try {
+        if (!nfp) transfer.enqueueReadBuffer(chars_mem.get_cl_buffer(), false, 0, size, conversion.chars, &computed);
+        transfer.enqueueReadBuffer(cols_mem.get_cl_buffer(), false, 0, size, conversion.cols, &computed);
+        transfer.enqueueReadBuffer(pal_mem.get_cl_buffer(), false, 0, 48, conversion.palette, &computed, &conversion.done);
+        transfer.flush();
+    } catch (std::exception &e) {
+        transfer.finish();
+        throw;
+    }
+    conversion.started = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void finishConvertImage_device(DeviceConversion& conversion, uchar** chars, uchar** cols, std::vector<Vec3b>& palette) {
+#ifdef HAS_OPENCL
+    conversion.done.wait();
+#endif
+    conversion.started = false;
+    *chars = conversion.chars;
+    *cols = conversion.cols;
+    conversion.chars = conversion.cols = NULL;
+    palette.resize(16);
+    for (int i = 0; i < 16; i++) palette[i] = {conversion.palette[i*3], conversion.palette[i*3+1], conversion.palette[i*3+2]};
+    if (conversion.lab) palette = convertLabPalette(palette);
+}
@@ -31,6 +31,11 @@ extern "C" {
 #include <zlib.h>
 }
 #include <Poco/URI.h>
+#include <Poco/Process.h>
+#include <Poco/File.h>
+#include <Poco/Path.h>
+#include <Poco/SHA1Engine.h>
+#include <Poco/TemporaryFile.h>
 #include <Poco/Util/OptionProcessor.h>
 #include <Poco/Util/OptionSet.h>
 #include <Poco/Util/OptionException.h>
@@ -51,9 +56,11 @@ extern "C" {
 #include <Poco/Net/WebSocket.h>
 #endif
 #include <chrono>
+#include <deque>
 #include <iomanip>
 #include <iostream>
 #include <fstream>
+#include <future>
 #include <sstream>
 #include <unordered_map>
 #include <csignal>
@@ -100,7 +107,7 @@ static long audioStorageSize = 0, totalFrames = 0;
 static std::mutex streamedLock;
 static std::condition_variable streamedNotify;
 static bool streamed = false;
-static bool useDFPWM = false;
+static bool useDFPWM = false, resume = false;
 static const std::vector<Vec3b> defaultPalette = {
     {0xf0, 0xf0, 0xf0},
     {0x33, 0xb2, 0xf2},
@@ -170,6 +177,76 @@ static double parseTime(const std::string& str) {
     return (str[0] - '0') * 3600 + (str[2] - '0') * 600 + (str[3] - '0') * 60 + (str[5] - '0') * 10 + (str[6] - '0') * 1 + (str[8] - '0') * 0.1 + (str[9] - '0') * 0.01;
 }
 
+// Parses a [[hh:]mm:]ss[.sss] timestamp into seconds
+static double parseTimestamp(const std::string& str) {
+    double retval = 0;
+    size_t start = 0, pos;
+    while ((pos = str.find(':', start)) != std::string::npos) {
+        retval = (retval + std::stoi(str.substr(start, pos - start))) * 60;
+        start = pos + 1;
+    }
+    return retval + std::stod(str.substr(start));
+}
+
+// Encoder state saved next to a combined 32vid output, so an interrupted encode can be resumed
+// The DFPWM encoder's state is private to libavcodec and isn't saved, so resumed DFPWM audio restarts it from silence
+struct Checkpoint {
+    std::string options;
+    uint64_t offset = 0;     // bytes of the output file that are complete
+    int frames = 0;          // video frames converted
+    int chunks = 0;          // frames written to the combined chunk
+    int videoFrames = 0;     // video frames written to the combined chunk
+    std::vector<uint32_t> index; // offsets of the indexed video frames written so far
+    int64_t video = 0;       // time of the next video frame to convert (AV_TIME_BASE, relative to input start)
+    int64_t samples = 0;     // audio samples written since the start of the clip
+    int64_t duration = 0;    // sum of the converted frames' durations
+    int64_t decimationStart = AV_NOPTS_VALUE, lastSlot = -1;
+};
+
+static bool readCheckpoint(const std::string& path, Checkpoint& cp) {
+    std::ifstream in(path);
+    if (!in.good()) return false;
+    std::string key;
+    while (in >> key) {
+        if (key == "options") {in.get(); std::getline(in, cp.options);}
+        else if (key == "offset") in >> cp.offset;
+        else if (key == "frames") in >> cp.frames;
+        else if (key == "chunks") in >> cp.chunks;
+        else if (key == "videoFrames") in >> cp.videoFrames;
+        else if (key == "index") {
+            size_t n = 0;
+            in >> n;
+            cp.index.resize(n);
+            for (size_t i = 0; i < n; i++) in >> cp.index[i];
+        }
+        else if (key == "video") in >> cp.video;
+        else if (key == "samples") in >> cp.samples;
+        else if (key == "duration") in >> cp.duration;
+        else if (key == "decimationStart") in >> cp.decimationStart;
+        else if (key == "lastSlot") in >> cp.lastSlot;
+        else return false;
+    }
+    return cp.offset >= 21;
+}
+
+static void writeCheckpoint(const std::string& path, const Checkpoint& cp) {
+    // Write to a temporary file and move it over the old one, so a crash can't leave a partial checkpoint behind
+    {
+        std::ofstream out(path + ".tmp");
+        out << "options " << cp.options << "\noffset " << cp.offset << "\nframes " << cp.frames << "\nchunks " << cp.chunks
+            << "\nvideo " << cp.video << "\nsamples " << cp.samples << "\nduration " << cp.duration
+            << "\ndecimationStart " << cp.decimationStart << "\nlastSlot " << cp.lastSlot << "\nvideoFrames " << cp.videoFrames << "\nindex " << cp.index.size();
+        for (uint32_t offset : cp.index) out << " " << offset;
+        out << "\n";
+        if (!out.good()) return;
+    }
+    try {
+        Poco::File(path + ".tmp").renameTo(path);
+    } catch (Poco::Exception &e) {
+        std::cerr << "Warning: Could not save checkpoint: " << e.displayText() << "\n";
+    }
+}
+
 static Vec3b parseColor(const std::string& str) {
     uint32_t color;
     if (str.substr(0, 2) == "&H") color = std::stoul(str.substr(2), NULL, 16);
@@ -456,48 +533,768 @@ void renderSubtitles(const std::unordered_multimap<int, ASSSubtitleEvent>& subti
 
 static std::unordered_multimap<int, ASSSubtitleEvent> subtitles;
 static OpenCL::Device * device = NULL;
-static std::string input, output, subtitle, format;
+static std::string input, output, subtitle, format, cacheDir, batchPath;
 static bool useDefaultPalette = false, noDither = false, useOctree = false, useKmeans = false, mute = false, binary = false, ordered = false, useLab = false, disableOpenCL = false, separateStreams = false, trimBorders = false, nfpize = false;
 static OutputType mode = OutputType::Default;
 static int compression = VID32_FLAG_VIDEO_COMPRESSION_ANS;
-static int port = 80, width = -1, height = -1, zlibCompression = 5, customPaletteCount = 16, monitorWidth = 0, monitorHeight = 0, monitorArrayWidth = 0, monitorArrayHeight = 0, monitorScale = 1;
+static double startTime = 0, clipDuration = 0;
+static int port = 80, decodeThreads = 0, scaleThreads = 0, scaler = SWS_BICUBIC, targetFPS = 0, segments = 1, shardIndex = 0, shardCount = 0, width = -1, height = -1, zlibCompression = 5, customPaletteCount = 16, monitorWidth = 0, monitorHeight = 0, monitorArrayWidth = 0, monitorArrayHeight = 0, monitorScale = 1;
 static Vec3b customPalette[16];
 static uint16_t customPaletteMask = 0;
+static int keyframeInterval = 0; // frames between full frames in 32vid videos, or 0 to only write full frames
+static int keyframeOffset = 0; // video frames before this part of a segmented video, which full frames are counted from
+static int batchJobs = 1; // worker processes that each convert part of a batch
+static bool keepDevice = false; // set while a batch owns the OpenCL device
+static bool useDevicePool = false;
+static std::vector<OpenCL::Device*> devicePool; // devices besides the main one opened for --device-pool, fastest first
+static std::string openclDevice; // index or name from --opencl-device, empty to pick the fastest device
 
-static void convertImage(Mat& rs, uchar ** characters, uchar ** colors, std::vector<Vec3b>& palette, size_t& width, size_t& height, int nframe) {
-    Mat labImage = (!useLab || useDefaultPalette) ? rs : makeLabImage(rs, device);
-    if (customPaletteMask == 0xFFFF) palette = std::vector<Vec3b>(customPalette, customPalette + 16);
-    else if (useDefaultPalette) palette = defaultPalette;
-    else if (useOctree) palette = reducePalette_octree(labImage, customPaletteCount, device);
-    else if (useKmeans) palette = reducePalette_kMeans(labImage, customPaletteCount, device);
-    else palette = reducePalette_medianCut(labImage, 16, device);
-    if (customPaletteMask && customPaletteCount) {
-        std::vector<Vec3b> newPalette(16);
-        for (int i = 0; i < 16; i++) {
-            if (customPaletteMask & (1 << i)) newPalette[i] = (useLab && !useDefaultPalette) ? convertColorToLab(customPalette[i]) : customPalette[i];
-            else if (palette.size() == 16) newPalette[i] = palette[i];
-            else {newPalette[i] = palette.back(); palette.pop_back();}
-        }
-        palette = newPalette;
-    }
-    Mat out;
-    if (noDither) out = thresholdImage(labImage, palette, device);
-    else if (ordered) out = ditherImage_ordered(labImage, palette, device);
-    else out = ditherImage(labImage, palette, device);
-    Mat1b pimg = rgbToPaletteImage(out, palette, device);
-    if (useLab && !useDefaultPalette) palette = convertLabPalette(palette);
-    if (nfpize) makeNFPCCImage(pimg, colors, device);
-    else makeCCImage(pimg, palette, characters, colors, device);
-    if (!subtitle.empty() && mode != OutputType::Vid32 && !nfpize) renderSubtitles(subtitles, nframe, *characters, *colors, palette, pimg.width, pimg.height);
-    width = pimg.width; height = pimg.height;
+// Stages of converting an image, which --autotune can move to the CPU one by one
+enum ConvertStage {STAGE_LAB, STAGE_PALETTE, STAGE_DITHER, STAGE_INDEX, STAGE_CC, STAGE_COUNT};
+static const char * const stageNames[STAGE_COUNT] = {"lab", "palette", "dither", "index", "cc"};
+static bool autotune = false, tuned = false;
+static uint8_t cpuStages = 0; // bit mask of the stages that run on the CPU even when there's a device
+
+// Restores the options and per-file state to their defaults before converting another file in the same process
+static void resetState() {
+    subtitles.clear();
+    frameStorage.clear();
+    free(audioStorage);
+    audioStorage = NULL;
+    audioStorageSize = totalFrames = 0;
+    input.clear(); output.clear(); subtitle.clear(); format.clear(); cacheDir.clear(); batchPath.clear();
+    useDefaultPalette = noDither = useOctree = useKmeans = mute = binary = ordered = useLab = disableOpenCL = separateStreams = trimBorders = nfpize = false;
+    streamed = useDFPWM = resume = false;
+    mode = OutputType::Default;
+    compression = VID32_FLAG_VIDEO_COMPRESSION_ANS;
+    startTime = clipDuration = 0;
+    port = 80; decodeThreads = scaleThreads = 0; scaler = SWS_BICUBIC; targetFPS = 0; segments = 1; shardIndex = shardCount = 0;
+    width = height = -1; zlibCompression = 5; customPaletteCount = 16;
+    monitorWidth = monitorHeight = monitorArrayWidth = monitorArrayHeight = 0; monitorScale = 1;
+    customPaletteMask = 0;
+    keyframeInterval = keyframeOffset = 0;
+    batchJobs = 1;
+    useDevicePool = false;
+    openclDevice.clear();
+    autotune = tuned = false;
+    cpuStages = 0;
 }
 
-int main(int argc, const char * argv[]) {
+#ifdef HAS_OPENCL
+// Opens a device and checks its kernels, returning NULL if it stopped responding
+static OpenCL::Device * openCheckedDevice(const OpenCL::Device_Info& info) {
+    OpenCL::Device * device = new OpenCL::Device(info);
+    switch (checkDitherDevice(device)) {
+        case 1: break;
+        case 0:
+            std::cerr << "Warning: OpenCL dithering does not match the CPU on " << info.name << ". Dithering will use the CPU.\n";
+            break;
+        default:
+            // The device is still stuck on the check, so it can't be used or even released safely
+            std::cerr << "Warning: OpenCL device " << info.name << " stopped responding. It will not be used.\n";
+            return NULL;
+    }
+    return device;
+}
+#endif
+
+// Opens the fastest OpenCL device (or the one picked with --opencl-device), returning NULL if none can be used; with --device-pool, the others go in devicePool
+static OpenCL::Device * openDevice() {
+#ifdef HAS_OPENCL
+    try {
+        // Keep compiled kernels around, since building them can take longer than converting a short file
+        std::string programCache = Poco::Path::cacheHome() + "sanjuuni/opencl";
+        Poco::File(programCache).createDirectories();
+        OpenCL::program_cache_directory() = programCache;
+    } catch (Poco::Exception &e) {
+        OpenCL::program_cache_directory() = "";
+    }
+    try {
+        std::vector<OpenCL::Device_Info> devices = OpenCL::get_devices();
+        OpenCL::Device_Info best = openclDevice.empty() ? OpenCL::select_device_with_most_flops(devices) :
+            openclDevice.find_first_not_of("0123456789") == std::string::npos ? OpenCL::select_device_with_id(std::stoi(openclDevice), devices) :
+            OpenCL::select_device_with_name(openclDevice, devices);
+        OpenCL::Device * device = openCheckedDevice(best);
+        if (device == NULL) std::cerr << "Warning: Falling back to CPU computation.\n";
+        else if (useDevicePool) {
+            std::sort(devices.begin(), devices.end(), [](const OpenCL::Device_Info& a, const OpenCL::Device_Info& b) {return a.tflops > b.tflops;});
+            for (const OpenCL::Device_Info& info : devices) {
+                if (info.cl_device == best.cl_device) continue;
+                try {
+                    OpenCL::Device * d = openCheckedDevice(info);
+                    if (d != NULL) devicePool.push_back(d);
+                } catch (std::exception &e) {
+                    std::cerr << "Warning: Could not open OpenCL device " << info.name << ": " << e.what() << ". It will not be used.\n";
+                }
+            }
+        }
+        return device;
+    } catch (std::exception &e) {
+        std::cerr << "Warning: Could not open OpenCL device: " << e.what() << ". Falling back to CPU computation.\n";
+    }
+#endif
+    return NULL;
+}
+
+// Releases the OpenCL devices
+static void closeDevices() {
+#ifdef HAS_OPENCL
+    if (device != NULL) delete device;
+    device = NULL;
+    for (OpenCL::Device * d : devicePool) delete d;
+    devicePool.clear();
+#endif
+}
+
+// Prints the OpenCL devices that --opencl-device can select, returning the exit code
+static int listDevices() {
+#ifdef HAS_OPENCL
+    try {
+        std::vector<OpenCL::Device_Info> devices = OpenCL::get_devices(false);
+        for (size_t i = 0; i < devices.size(); i++) OpenCL::print_device_info(devices[i], i);
+        return 0;
+    } catch (std::exception &e) {
+        std::cerr << "Could not list OpenCL devices: " << e.what() << "\n";
+        return 1;
+    }
+#else
+    std::cerr << "This build of sanjuuni does not support OpenCL\n";
+    return 1;
+#endif
+}
+
+static std::future<OpenCL::Device*> pendingDevice;
+
+// Starts opening the OpenCL device in the background, so decoding can start while the kernels compile
+static void startDevice() {
+    pendingDevice = std::async(std::launch::async, openDevice);
+}
+
+// Switches to the OpenCL device once it has finished opening, returning whether it did; frames before that use the CPU
+static bool takeDevice(bool wait = false) {
+    if (!pendingDevice.valid() || (!wait && pendingDevice.wait_for(seconds(0)) != std::future_status::ready)) return false;
+    device = pendingDevice.get();
+    return device != NULL;
+}
+
+// Stops waiting for a device that is still opening, so short conversions don't block on the kernels compiling
+// The future is handed to a detached thread, since destroying it here would wait for openDevice to return
+static void abandonDevice() {
+    if (pendingDevice.valid()) std::thread([](std::future<OpenCL::Device*> f) {}, std::move(pendingDevice)).detach();
+}
+
+static void noFree(void*, uint8_t*) {}
+
+// Returns the number of slices to scale an image of the specified height in
+// Scaling separate slices needs the slice API from libswscale 6 (FFmpeg 5), so older versions use one context
+static int scaleSliceCount(int height) {
+#if LIBSWSCALE_VERSION_MAJOR >= 6
+    int slices = scaleThreads ? scaleThreads : (int)std::thread::hardware_concurrency();
+    return max(min(slices, height / 16), 1);
+#else
+    return 1;
+#endif
+}
+
+// Scales src into out; with more than one context, each one scales a horizontal slice on the work queue
+static int scaleSlices(const std::vector<SwsContext*>& contexts, AVFrame * src, AVFrame * out) {
+#if LIBSWSCALE_VERSION_MAJOR >= 6
+    if (contexts.size() == 1)
+#endif
+        return sws_scale(contexts[0], src->data, src->linesize, 0, src->height, out->data, out->linesize);
+#if LIBSWSCALE_VERSION_MAJOR >= 6
+    unsigned align = sws_receive_slice_alignment(contexts[0]);
+    unsigned sliceHeight = (out->height + contexts.size() - 1) / contexts.size();
+    sliceHeight = (sliceHeight + align - 1) / align * align;
+    std::atomic_int error(0);
+    for (size_t i = 0; i < contexts.size() && i * sliceHeight < out->height; i++) {
+        SwsContext * ctx = contexts[i];
+        unsigned start = i * sliceHeight, height = min(sliceHeight, out->height - start);
+        work.push([ctx, src, out, start, height, &error]() {
+            int err;
+            if ((err = sws_frame_start(ctx, out, src)) < 0) {error = err; return;}
+            if ((err = sws_send_slice(ctx, 0, src->height)) < 0 || (err = sws_receive_slice(ctx, start, height)) < 0) error = err;
+            sws_frame_end(ctx);
+        });
+    }
+    work.wait();
+    return error;
+#endif
+}
+
+// Wraps an image in a BGR24 frame without copying it
+static AVFrame * frameForMat(Mat& image) {
+    AVFrame * frame = av_frame_alloc();
+    frame->width = image.width;
+    frame->height = image.height;
+    frame->format = AV_PIX_FMT_BGR24;
+    frame->data[0] = (uint8_t*)image.data();
+    frame->linesize[0] = image.stride * 3;
+    frame->buf[0] = av_buffer_create(frame->data[0], (size_t)image.stride * image.height * 3, noFree, NULL, 0);
+    return frame;
+}
+
+// Scales a frame into dst, optionally shrinking it into an intermediate frame first
+static int scaleFrame(const std::vector<SwsContext*>& contexts, AVFrame * src, Mat& dst, const std::vector<SwsContext*>& precontexts = {}, AVFrame * prescaled = NULL) {
+    int error;
+    if (prescaled) {
+        if ((error = scaleSlices(precontexts, src, prescaled)) < 0) return error;
+        src = prescaled;
+    }
+    AVFrame * out = frameForMat(dst);
+    error = scaleSlices(contexts, src, out);
+    av_frame_free(&out);
+    return error;
+}
+
+// Returns the path of the cache entry for converting an image with the current options
+static std::string cachePath(Mat& image) {
+    Poco::SHA1Engine sha;
+    std::stringstream opts;
+    opts << "sanjuuni-cc 1 " << image.width << "x" << image.height << " " << useDefaultPalette << noDither << ordered << useLab << useOctree << useKmeans << nfpize << " " << customPaletteCount << " " << customPaletteMask;
+    for (int i = 0; i < 16; i++) if (customPaletteMask & (1 << i)) opts << " " << (int)customPalette[i][0] << "," << (int)customPalette[i][1] << "," << (int)customPalette[i][2];
+    sha.update(opts.str());
+    image.download();
+    for (unsigned y = 0; y < image.height; y++) sha.update(&image.at(y, 0), image.width * sizeof(uchar3));
+    std::string hash = Poco::DigestEngine::digestToHex(sha.digest());
+    return cacheDir + "/" + hash.substr(0, 2) + "/" + hash.substr(2);
+}
+
+static bool readCachedImage(const std::string& path, uchar ** characters, uchar ** colors, std::vector<Vec3b>& palette, size_t& width, size_t& height) {
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    if (!in.good()) return false;
+    char magic[4];
+    uint32_t w, h;
+    uint8_t npal, hasCharacters;
+    in.read(magic, 4);
+    in.read((char*)&w, 4);
+    in.read((char*)&h, 4);
+    npal = in.get();
+    hasCharacters = in.get();
+    if (!in.good() || memcmp(magic, "SJCC", 4) != 0 || (hasCharacters != 0) == nfpize) return false;
+    std::vector<Vec3b> pal(npal);
+    for (Vec3b& c : pal) in.read((char*)c.data(), 3);
+    size_t size = (h / 3) * (w / 2);
+    uchar * chars = hasCharacters ? new uchar[size] : NULL, * cols = new uchar[size];
+    if (chars) in.read((char*)chars, size);
+    in.read((char*)cols, size);
+    if (!in.good()) {
+        if (chars) delete[] chars;
+        delete[] cols;
+        return false;
+    }
+    *characters = chars;
+    *colors = cols;
+    palette = pal;
+    width = w; height = h;
+    return true;
+}
+
+static void writeCachedImage(const std::string& path, const uchar * characters, const uchar * colors, const std::vector<Vec3b>& palette, size_t width, size_t height) {
+    // Other processes may share the cache, so only ever move complete entries into place
+    // The temporary name includes the process ID and a counter, so no two writers can share it
+    const std::string dir = path.substr(0, path.find_last_of('/'));
+    std::string tmp;
+    try {
+        Poco::File(dir).createDirectories();
+        tmp = Poco::TemporaryFile::tempName(dir);
+        {
+            std::ofstream out(tmp, std::ios::out | std::ios::binary);
+            uint32_t w = width, h = height;
+            size_t size = (height / 3) * (width / 2);
+            out.write("SJCC", 4);
+            out.write((char*)&w, 4);
+            out.write((char*)&h, 4);
+            out.put(palette.size());
+            out.put(characters != NULL);
+            for (const Vec3b& c : palette) out.write((const char*)c.data(), 3);
+            if (characters) out.write((const char*)characters, size);
+            out.write((const char*)colors, size);
+            if (!out.good()) throw Poco::WriteFileException(tmp);
+        }
+        Poco::File(tmp).renameTo(path);
+    } catch (Poco::Exception &e) {
+        std::cerr << "Warning: Could not write to conversion cache: " << e.displayText() << "\n";
+        std::remove(tmp.c_str());
+    }
+}
+
+// An image being converted, from startConvertImage until finishConvertImage
+struct PendingImage {
+    uchar * characters = NULL, * colors = NULL;
+    std::vector<Vec3b> palette;
+    size_t width = 0, height = 0;
+    int nframe = 0;
+    std::string cached;
+    Mat labStorage; // read by the device until the conversion is finished
+    bool onDevice = false;
+    DeviceConversion conversion;
+};
+
+static void tuneStages(Mat& rs, OpenCL::Device * dev);
+
+// Starts converting an image on dev. The default median cut path is only queued on the device, using the result buffers
+// of the given slot, so the next image can be started before this one is finished; everything else is done right away.
+static void startConvertImage(Mat& rs, PendingImage& image, int nframe, int slot = 0, const std::vector<Vec3b> * fixedPalette = NULL, OpenCL::Device * dev = device) {
+    if (autotune && !tuned && dev != NULL) tuneStages(rs, dev);
+    image.width = rs.width; image.height = rs.height;
+    image.nframe = nframe;
+    if (!cacheDir.empty() && !fixedPalette) {
+        image.cached = cachePath(rs);
+        if (readCachedImage(image.cached, &image.characters, &image.colors, image.palette, image.width, image.height)) {
+            image.cached.clear();
+            return;
+        }
+    }
+    OpenCL::Device * stageDevice[STAGE_COUNT]; // where each stage runs; images passed to a stage on the device get device memory first
+    for (int i = 0; i < STAGE_COUNT; i++) stageDevice[i] = (cpuStages & (1 << i)) ? NULL : dev;
+    if (useLab && !useDefaultPalette) {
+        rs.attach(stageDevice[STAGE_LAB]);
+        image.labStorage = makeLabImage(rs, stageDevice[STAGE_LAB]);
+    }
+    Mat& labImage = (!useLab || useDefaultPalette) ? rs : image.labStorage;
+    std::vector<Vec3b>& palette = image.palette;
+    image.onDevice = dev != NULL && !cpuStages && !fixedPalette && !customPaletteMask && !useDefaultPalette && !useOctree && !useKmeans && !ordered &&
+        startConvertImage_device(labImage, useLab, !noDither, nfpize, slot, image.conversion, dev);
+    if (!image.onDevice) {
+        if (fixedPalette) {
+            palette = *fixedPalette;
+            if (useLab && !useDefaultPalette) for (Vec3b& c : palette) c = convertColorToLab(c);
+        } else if (customPaletteMask == 0xFFFF) palette = std::vector<Vec3b>(customPalette, customPalette + 16);
+        else if (useDefaultPalette) palette = defaultPalette;
+        else {
+            labImage.attach(stageDevice[STAGE_PALETTE]);
+            if (useOctree) palette = reducePalette_octree(labImage, customPaletteCount, stageDevice[STAGE_PALETTE]);
+            else if (useKmeans) palette = reducePalette_kMeans(labImage, customPaletteCount, stageDevice[STAGE_PALETTE]);
+            else palette = reducePalette_medianCut(labImage, 16, stageDevice[STAGE_PALETTE]);
+        }
+        if (customPaletteMask && customPaletteCount && !fixedPalette) {
+            std::vector<Vec3b> newPalette(16);
+            for (int i = 0; i < 16; i++) {
+                if (customPaletteMask & (1 << i)) newPalette[i] = (useLab && !useDefaultPalette) ? convertColorToLab(customPalette[i]) : customPalette[i];
+                else if (palette.size() == 16) newPalette[i] = palette[i];
+                else {newPalette[i] = palette.back(); palette.pop_back();}
+            }
+            palette = newPalette;
+        }
+        Mat out;
+        labImage.attach(stageDevice[STAGE_DITHER]);
+        if (noDither) out = thresholdImage(labImage, palette, stageDevice[STAGE_DITHER]);
+        else if (ordered) out = ditherImage_ordered(labImage, palette, stageDevice[STAGE_DITHER]);
+        else out = ditherImage(labImage, palette, stageDevice[STAGE_DITHER]);
+        out.attach(stageDevice[STAGE_INDEX]);
+        Mat1b pimg = rgbToPaletteImage(out, palette, stageDevice[STAGE_INDEX]);
+        if (fixedPalette) palette = *fixedPalette;
+        else if (useLab && !useDefaultPalette) palette = convertLabPalette(palette);
+        pimg.attach(stageDevice[STAGE_CC]);
+        if (nfpize) makeNFPCCImage(pimg, &image.colors, stageDevice[STAGE_CC]);
+        else makeCCImage(pimg, palette, &image.characters, &image.colors, stageDevice[STAGE_CC]);
+    }
+}
+
+// Waits for an image to finish converting; the caller takes over its characters and colors
+static void finishConvertImage(PendingImage& image) {
+    if (image.onDevice) {
+        finishConvertImage_device(image.conversion, &image.characters, &image.colors, image.palette);
+        image.onDevice = false;
+    }
+    if (!image.cached.empty()) writeCachedImage(image.cached, image.characters, image.colors, image.palette, image.width, image.height);
+    if (!subtitle.empty() && mode != OutputType::Vid32 && !nfpize) renderSubtitles(subtitles, image.nframe, image.characters, image.colors, image.palette, image.width, image.height);
+}
+
+// Converts an image to characters and colors; if fixedPalette is set, the image is dithered to that palette instead of generating one
+static void convertImage(Mat& rs, uchar ** characters, uchar ** colors, std::vector<Vec3b>& palette, size_t& width, size_t& height, int nframe, const std::vector<Vec3b> * fixedPalette = NULL) {
+    PendingImage image;
+    startConvertImage(rs, image, nframe, 0, fixedPalette);
+    finishConvertImage(image);
+    *characters = image.characters; *colors = image.colors;
+    palette = image.palette;
+    width = image.width; height = image.height;
+}
+
+// Times converting an image with each placement of the active stages on the CPU and dev, and keeps the fastest one in cpuStages
+// The choice is saved per device, size and options, so later runs with the same settings skip the timing
+static void tuneStages(Mat& rs, OpenCL::Device * dev) {
+    tuned = true;
+#ifdef HAS_OPENCL
+    uint8_t active = (1 << STAGE_DITHER) | (1 << STAGE_INDEX) | (1 << STAGE_CC);
+    if (useLab && !useDefaultPalette) active |= 1 << STAGE_LAB;
+    if (customPaletteMask != 0xFFFF && !useDefaultPalette) active |= 1 << STAGE_PALETTE;
+    std::stringstream key;
+    key << dev->info.name << " " << dev->info.driver_version << " " << rs.width << "x" << rs.height << " " << useDefaultPalette << noDither << ordered << useLab << useOctree << useKmeans << nfpize << " " << (customPaletteMask != 0);
+    std::string path;
+    try {
+        path = Poco::Path::cacheHome() + "sanjuuni/autotune";
+    } catch (Poco::Exception &e) {}
+    bool found = false;
+    if (!path.empty()) {
+        // Later lines win, so a device that was tuned again replaces its old entry
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line)) {
+            size_t tab = line.find('\t');
+            if (tab != std::string::npos && line.substr(0, tab) == key.str()) {
+                cpuStages = atoi(line.substr(tab + 1).c_str()) & active;
+                found = true;
+            }
+        }
+    }
+    if (!found) {
+        std::string savedCacheDir = cacheDir;
+        cacheDir.clear();
+        double best = INFINITY;
+        uint8_t bestStages = 0;
+        for (unsigned stages = 0; stages < (1 << STAGE_COUNT); stages++) {
+            if (stages & ~active) continue;
+            cpuStages = stages;
+            double time = INFINITY;
+            // Take the best of a few runs, so the first one doesn't pay for allocating buffers
+            for (int i = 0; i < 3; i++) {
+                rs.download();
+                rs.onDevice = false;
+                PendingImage image;
+                auto start = system_clock::now();
+                startConvertImage(rs, image, 0, 0, NULL, dev);
+                finishConvertImage(image);
+                time = std::min(time, duration_cast<duration<double>>(system_clock::now() - start).count());
+                if (image.characters) delete[] image.characters;
+                delete[] image.colors;
+            }
+            if (time < best) {
+                best = time;
+                bestStages = stages;
+            }
+        }
+        cacheDir = savedCacheDir;
+        cpuStages = bestStages;
+        if (!path.empty()) {
+            try {
+                Poco::File(path.substr(0, path.find_last_of('/'))).createDirectories();
+                std::ofstream out(path, std::ios::app);
+                out << key.str() << "\t" << (int)cpuStages << "\n";
+            } catch (Poco::Exception &e) {
+                std::cerr << "Warning: Could not save autotuning results: " << e.displayText() << "\n";
+            }
+        }
+    }
+    std::cerr << "Autotuned stages for " << rs.width << "x" << rs.height << " on " << dev->info.name << (found ? " (cached):" : ":");
+    for (int i = 0; i < STAGE_COUNT; i++) if (active & (1 << i)) std::cerr << " " << stageNames[i] << "=" << ((cpuStages & (1 << i)) ? "cpu" : "opencl");
+    std::cerr << "\n";
+#endif
+}
+
+// One monitor's part of a frame in multi-monitor mode
+struct MonitorTile {
+    int mx, my; // monitor position, starting at 1
+    int x, y, width, height; // area of the frame
+    size_t device = 0; // index into the devices converting this frame
+    int slot = 0;
+    Mat crop;
+    PendingImage image;
+    MonitorTile(int mx, int my, int x, int y, int w, int h): mx(mx), my(my), x(x), y(y), width(w), height(h) {}
+};
+
+// A frame that has been started converting, and is written out once the next frame has been started
+struct PendingFrame {
+    std::shared_ptr<Mat> rs;
+    size_t device = 0; // index of the device converting it: 0 for the main device, then the --device-pool devices
+    int slot = 0;
+    PendingImage image;
+    std::vector<std::shared_ptr<Mat>> rungs; // scaled images for the ladder rungs, converted with this frame's palette when it's written
+    int nframe = 0;
+    double duration = 0;
+};
+
+// A combined 32vid stream being written: the last frame, which the next frame can be coded against as a delta frame,
+// and the offsets of the video frames for the CombinedIndex chunk
+struct Vid32StreamState {
+    std::vector<uchar> characters, colors;
+    uint32_t nvideo = 0;                 // video frames written so far
+    uint32_t offset = 0;                 // video frames before this stream in the merged video, for placing full frames
+    int indexStep = 0;                   // video frames per index entry, or 0 to not index the stream
+    std::vector<uint32_t> index;         // file offsets of every indexStep-th video frame
+    std::vector<std::streamoff> pending; // offsets of indexed frames that are still in the video buffer
+    // Call before each video frame is added to the buffer
+    void mark(std::ostream& buf) {
+        if (indexStep && nvideo % indexStep == 0) pending.push_back(buf.tellp());
+        nvideo++;
+    }
+    // Call when the video buffer is written to the file at the specified position
+    void flush(std::streamoff pos) {
+        for (std::streamoff off : pending) index.push_back(pos + off);
+        pending.clear();
+    }
+};
+
+// Returns the number of video frames between index entries for a combined 32vid stream
+// Every indexed frame is a full frame, so this is the keyframe interval when delta frames are enabled
+static int indexStepFor(double fps) {
+    if (keyframeInterval) return keyframeInterval;
+    return min(max((int)floor(fps + 0.5), 1), 255);
+}
+
+// Encodes a frame for a combined 32vid stream with the selected compression, returning an empty string on failure
+// With a stream state and --keyframe-interval, the frame is stored as a delta frame when that's smaller, and type is set to match
+static std::string make32vidFrame(const uchar * characters, const uchar * colors, const std::vector<Vec3b>& palette, int width, int height, Vid32StreamState * stream = NULL, Vid32Chunk::Type * type = NULL) {
+    std::string data;
+    if (type) *type = Vid32Chunk::Type::Video;
+    if (stream && keyframeInterval && compression == VID32_FLAG_VIDEO_COMPRESSION_ANS) {
+        size_t size = width * height;
+        data = make32vid_ans(characters, colors, palette, width, height);
+        if (stream->colors.size() == size && (stream->offset + stream->nvideo) % keyframeInterval != 0) {
+            std::string d = make32vid_delta(characters, colors, palette, stream->characters.empty() ? NULL : stream->characters.data(), stream->colors.data(), width, height);
+            if (d.size() < data.size()) {
+                data = d;
+                if (type) *type = Vid32Chunk::Type::VideoDelta;
+            }
+        }
+        stream->characters = characters ? std::vector<uchar>(characters, characters + size) : std::vector<uchar>();
+        stream->colors = std::vector<uchar>(colors, colors + size);
+        return data;
+    }
+    if (compression == VID32_FLAG_VIDEO_COMPRESSION_CUSTOM) data = make32vid_cmp(characters, colors, palette, width, height);
+    else if (compression == VID32_FLAG_VIDEO_COMPRESSION_ANS) data = make32vid_ans(characters, colors, palette, width, height);
+    else data = make32vid(characters, colors, palette, width, height);
+    if (compression == VID32_FLAG_VIDEO_COMPRESSION_DEFLATE) {
+        unsigned long size = compressBound(data.size());
+        uint8_t * buf = new uint8_t[size];
+        if (compress2(buf, &size, (const uint8_t*)data.c_str(), data.size(), compression) != Z_OK) {
+            delete[] buf;
+            return "";
+        }
+        data = std::string((const char*)buf + 2, size - 6);
+        delete[] buf;
+    }
+    return data;
+}
+
+// A converted frame, shared between the writers of extra outputs
+struct CCFrame {
+    std::vector<uchar> characters, colors;
+    std::vector<Vec3b> palette;
+    int width, height; // in characters
+    double duration;
+    CCFrame(const uchar * chars, const uchar * cols, const std::vector<Vec3b>& pal, int w, int h, double d):
+        characters(chars ? std::vector<uchar>(chars, chars + w * h) : std::vector<uchar>()), colors(cols, cols + w * h), palette(pal), width(w), height(h), duration(d) {}
+    const uchar * chars() const {return characters.empty() ? NULL : characters.data();}
+};
+
+// An additional file output (-o format:path) that is written from the same converted frames as the main output,
+// on a writer thread of its own
+class ExtraOutput {
+    std::ofstream file;
+    std::stringstream vid32stream; // video frames waiting for the next audio chunk
+    Vid32StreamState stream;
+    uint32_t nframes = 0;
+    int nvideo = 0;
+    WorkQueue writer {1};
+public:
+    const OutputType mode;
+    const std::string path;
+    const int width, height; // size of a ladder rung in pixels, or 0 to use the main output's frames
+    ExtraOutput(OutputType m, const std::string& p, int w = 0, int h = 0): mode(m), path(p), width(w), height(h) {}
+    bool open() {
+        file.open(path, std::ios::out | std::ios::binary);
+        return file.good();
+    }
+    void start(int mainWidth, int mainHeight, double fps) {
+        int width = this->width ? this->width : mainWidth, height = this->height ? this->height : mainHeight;
+        writer.push([this, width, height, fps]() {
+            if (mode == OutputType::Raw) file << "32Vid 1.1\n" << fps << "\n";
+            else if (mode == OutputType::BlitImage) file << (binary ? "{" : "{\n");
+            else if (mode == OutputType::Vid32) {
+                Vid32Header header;
+                Vid32Chunk chunk;
+                memcpy(header.magic, "32VD", 4);
+                header.width = width / 2;
+                header.height = height / 3;
+                header.fps = floor(fps + 0.5);
+                header.nstreams = 1;
+                header.flags = compression | VID32_FLAG_VIDEO_5BIT_CODES;
+                if (useDFPWM) header.flags |= VID32_FLAG_AUDIO_COMPRESSION_DFPWM;
+                chunk.size = chunk.nframes = 0;
+                chunk.type = (uint8_t)Vid32Chunk::Type::Combined;
+                file.write((char*)&header, 12);
+                file.write((char*)&chunk, 9);
+                stream.indexStep = indexStepFor(fps);
+            }
+        });
+    }
+    void writeFrame(std::shared_ptr<const CCFrame> frame) {
+        writer.push([this, frame]() {
+            const CCFrame& f = *frame;
+            nvideo++;
+            switch (mode) {
+            case OutputType::Lua: file << makeLuaFile(f.chars(), f.colors.data(), f.palette, f.width, f.height) << "sleep(" << f.duration << ")\n"; break;
+            case OutputType::NFP: file << makeNFP(f.chars(), f.colors.data(), f.palette, f.width, f.height); break;
+            case OutputType::Raw: file << makeRawImage(f.chars(), f.colors.data(), f.palette, f.width, f.height); break;
+            case OutputType::BlitImage: file << makeTable(f.chars(), f.colors.data(), f.palette, f.width, f.height, binary, true, binary) << (binary ? "," : ",\n"); break;
+            case OutputType::Vid32: {
+                Vid32Chunk::Type type;
+                std::string data = make32vidFrame(f.chars(), f.colors.data(), f.palette, f.width, f.height, &stream, &type);
+                if (data.empty()) {
+                    std::cerr << "Could not compress video for " << path << "!\n";
+                    return;
+                }
+                stream.mark(vid32stream);
+                uint32_t size = data.size();
+                vid32stream.write((const char*)&size, 4);
+                vid32stream.put((char)type);
+                vid32stream.write(data.c_str(), data.size());
+                nframes++;
+                break;
+            }
+            default: break;
+            }
+        });
+    }
+    void writeAudio(std::shared_ptr<const std::string> chunk) {
+        if (mode != OutputType::Vid32) return;
+        writer.push([this, chunk]() {
+            uint32_t size = chunk->size();
+            file.write((const char*)&size, 4);
+            file.put((char)Vid32Chunk::Type::Audio);
+            file.write(chunk->c_str(), size);
+            nframes++;
+            stream.flush(file.tellp());
+            std::string vdata = vid32stream.str();
+            file.write(vdata.c_str(), vdata.size());
+            vid32stream = std::stringstream();
+        });
+    }
+    // Writes the end of the file and waits for the writer to finish
+    void finish(double fps) {
+        writer.push([this, fps]() {
+            if (mode == OutputType::Vid32) {
+                stream.flush(file.tellp());
+                std::string vdata = vid32stream.str();
+                file.write(vdata.c_str(), vdata.size());
+                Vid32Chunk chunk;
+                chunk.size = (size_t)file.tellp() - 21;
+                chunk.nframes = nframes;
+                chunk.type = (uint8_t)Vid32Chunk::Type::Combined;
+                if (!stream.index.empty()) file << make32vid_index(stream.index, stream.indexStep);
+                file.seekp(8, std::ios::beg);
+                file.put(floor(fps + 0.5));
+                file.put(stream.index.empty() ? 1 : 2);
+                file.seekp(12, std::ios::beg);
+                file.write((const char*)&chunk, 9);
+            } else if (mode == OutputType::BlitImage) {
+                char timestr[26];
+                time_t now = time(0);
+                struct tm * time = gmtime(&now);
+                strftime(timestr, 26, "%FT%T%z", time);
+                if (binary) file << "creator='sanjuuni',version='1.0.0',secondsPerFrame=" << (1.0 / fps) << ",animation=" << (nvideo > 1 ? "true" : "false") << ",date='" << timestr << "',title='" << input << "'}";
+                else file << "creator = 'sanjuuni',\nversion = '1.0.0',\nsecondsPerFrame = " << (1.0 / fps) << ",\nanimation = " << (nvideo > 1 ? "true" : "false") << ",\ndate = '" << timestr << "',\ntitle = '" << input << "'\n}\n";
+            } else if (mode == OutputType::Lua) {
+                if (nvideo == 1) file << "read()\n";
+                file << "for i = 0, 15 do term.setPaletteColor(2^i, term.nativePaletteColor(2^i)) end\nterm.setBackgroundColor(colors.black)\nterm.setTextColor(colors.white)\nterm.setCursorPos(1, 1)\nterm.clear()\n";
+            }
+            file.close();
+        });
+        writer.wait();
+    }
+};
+
+// A rung of a resolution ladder (--ladder=WxH:path): a 32vid output at its own size, scaled from the same decoded frames
+// and dithered to the palette generated for the main output
+struct LadderRung {
+    ExtraOutput * output;
+    std::vector<SwsContext*> resize_ctx;
+    bool fromSource = false; // scaled from the decoded frame, if the rung is larger than the main output
+    std::unique_ptr<FramePool<uchar3>> framePool;
+};
+
+// Splits the selected part of the input into n time ranges that start on keyframes, returning n+1 boundaries
+// relative to the start of the input; ranges may be empty if keyframes are sparse
+// The result only depends on the input and options, so separate processes agree on the ranges
+static std::vector<int64_t> segmentBounds(AVFormatContext * format_ctx, int video_stream, int n) {
+    const int64_t inputStart = format_ctx->start_time != AV_NOPTS_VALUE ? format_ctx->start_time : 0;
+    int64_t begin = llround(startTime * AV_TIME_BASE), end;
+    if (clipDuration > 0) end = begin + llround(clipDuration * AV_TIME_BASE);
+    else if (format_ctx->duration != AV_NOPTS_VALUE) end = format_ctx->duration;
+    else return {};
+    std::vector<int64_t> bounds = {begin};
+    AVPacket * packet = av_packet_alloc();
+    for (int i = 1; i < n; i++) {
+        int64_t target = begin + (end - begin) * i / n, bound = bounds.back();
+        if (avformat_seek_file(format_ctx, -1, INT64_MIN, inputStart + target, inputStart + target, 0) >= 0) {
+            // The first video packet after seeking is the keyframe that the segment will start on
+            while (av_read_frame(format_ctx, packet) >= 0) {
+                bool found = packet->stream_index == video_stream;
+                int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+                if (found && pts != AV_NOPTS_VALUE) bound = av_rescale_q(pts, format_ctx->streams[video_stream]->time_base, AVRational{1, AV_TIME_BASE}) - inputStart;
+                av_packet_unref(packet);
+                if (found) break;
+            }
+        }
+        bounds.push_back(min(max(bound, bounds.back()), end));
+    }
+    av_packet_free(&packet);
+    bounds.push_back(end);
+    avformat_seek_file(format_ctx, -1, INT64_MIN, inputStart, inputStart, 0);
+    return bounds;
+}
+
+// Returns roughly how many output frames come before a segment boundary, for lining up the parts' full frames
+// This assumes a constant framerate; if it's off, the parts still merge, but the merged video can't be indexed
+static int framesBefore(AVFormatContext * format_ctx, int video_stream, int64_t begin, int64_t bound) {
+    double fps = av_q2d(av_guess_frame_rate(format_ctx, format_ctx->streams[video_stream], NULL));
+    if (targetFPS && (fps < 1 || fps > targetFPS)) fps = targetFPS;
+    return max((int)llround((bound - begin) * fps / AV_TIME_BASE), 0);
+}
+
+// Encodes each segment of the input in a separate process, and stitches the parts together
+static int encodeSegments(AVFormatContext * format_ctx, int video_stream, const std::string& program, const std::vector<std::string>& args) {
+    std::vector<int64_t> bounds = segmentBounds(format_ctx, video_stream, segments);
+    if (bounds.empty()) {
+        std::cerr << "Could not determine the length of the input, which is required for segmented encoding\n";
+        return 2;
+    }
+    std::vector<std::string> parts;
+    std::vector<Poco::ProcessHandle> processes;
+    int retval = 0;
+    char time[32];
+    for (size_t i = 0; i + 1 < bounds.size(); i++) {
+        if (bounds[i] == bounds[i+1]) continue;
+        Poco::Process::Args segmentArgs = args;
+        snprintf(time, 32, "%.6f", bounds[i] / (double)AV_TIME_BASE);
+        segmentArgs.push_back("--start=" + std::string(time));
+        snprintf(time, 32, "%.6f", (bounds[i+1] - bounds[i]) / (double)AV_TIME_BASE);
+        segmentArgs.push_back("--duration=" + std::string(time));
+        if (keyframeInterval) segmentArgs.push_back("--keyframe-offset=" + std::to_string(framesBefore(format_ctx, video_stream, bounds[0], bounds[i])));
+        parts.push_back(output + ".part" + std::to_string(i));
+        segmentArgs.push_back("--output=" + parts.back());
+        try {
+            processes.push_back(Poco::Process::launch(program, segmentArgs));
+        } catch (Poco::Exception &e) {
+            std::cerr << "Could not start encoder for segment " << i << ": " << e.displayText() << "\n";
+            retval = 2;
+            break;
+        }
+    }
+    for (Poco::ProcessHandle& process : processes) if (process.wait() != 0) retval = 2;
+    if (retval == 0) {
+        std::ofstream outfile(output, std::ios::out | std::ios::binary);
+        std::string err = outfile.good() ? merge32vid(parts, outfile) : "Could not open output file!";
+        if (!err.empty()) {
+            std::cerr << err << "\n";
+            retval = 1;
+        }
+    } else std::cerr << "One or more segments failed to encode\n";
+    for (const std::string& part : parts) std::remove(part.c_str());
+    return retval;
+}
+
+static int runBatch(const char * argv0, const std::vector<std::string>& args);
+
+static int convert(int argc, const char * argv[]) {
+    resetState();
     OptionSet options;
-    options.addOption(Option("input", "i", "Input image or video", true, "file", true));
+    options.addOption(Option("input", "i", "Input image or video", false, "file", true));
     options.addOption(Option("subtitle", "S", "ASS-formatted subtitle file to add to the video", false, "file", true));
     options.addOption(Option("format", "f", "Force a format to use for the input file", false, "format", true));
-    options.addOption(Option("output", "o", "Output file path", false, "path", true));
+    options.addOption(Option("output", "o", "Output file path; repeat with a format prefix (lua:, nfp:, raw:, bimg: or 32vid:) to write more formats from the same conversion", false, "[format:]path", true).repeatable(true));
     options.addOption(Option("lua", "l", "Output a Lua script file (default)"));
     options.addOption(Option("nfp", "n", "Output an NFP format image for use in paint (changes proportions!)"));
     options.addOption(Option("raw", "r", "Output a rawmode-based image/video file"));
@@ -515,6 +1312,8 @@ int main(int argc, const char * argv[]) {
     options.addOption(Option("octree", "8", "Use octree for higher quality color conversion (slower)"));
     options.addOption(Option("kmeans", "k", "Use k-means for highest quality color conversion (slowest)"));
     options.addOption(Option("compression", "c", "Compression type for 32vid videos; available modes: none|ans|deflate|custom", false, "mode", true).validator(new RegExpValidator("^(none|lzw|deflate|custom)$")));
+    options.addOption(Option("keyframe-interval", "", "Store 32vid frames as the cells that changed since the last frame when smaller, with a full frame every n frames (requires ANS compression; 0 = only full frames)", false, "n", true).validator(new IntValidator(0, 255)));
+    options.addOption(Option("keyframe-offset", "", "Count --keyframe-interval from n frames before the start, so a part of a video has its full frames where the whole video would (set by --segments)", false, "n", true));
     options.addOption(Option("binary", "B", "Output blit image files in a more-compressed binary format (requires opening the file in binary mode)"));
     options.addOption(Option("nfpize", "N", "Reduce visual resolution to NFP quality - good for compressed formats, or for keeping aspect ratio in NFP outputs"));
     options.addOption(Option("separate-streams", "S", "Output 32vid files using separate streams (slower to decode)"));
@@ -522,21 +1321,63 @@ int main(int argc, const char * argv[]) {
     options.addOption(Option("mute", "m", "Remove audio from output"));
     options.addOption(Option("width", "W", "Resize the image to the specified width", false, "size", true).validator(new IntValidator(1, 65535)));
     options.addOption(Option("height", "H", "Resize the image to the specified height", false, "size", true).validator(new IntValidator(1, 65535)));
+    options.addOption(Option("start", "", "Start encoding the video at the specified time ([[hh:]mm:]ss[.sss])", false, "time", true).validator(new RegExpValidator("^(?:(?:[0-9]+:)?[0-9]+:)?[0-9]+(?:\\.[0-9]+)?$")));
+    options.addOption(Option("duration", "", "Only encode the specified length of video ([[hh:]mm:]ss[.sss])", false, "time", true).validator(new RegExpValidator("^(?:(?:[0-9]+:)?[0-9]+:)?[0-9]+(?:\\.[0-9]+)?$")));
+    options.addOption(Option("fps", "", "Drop frames to limit the video to the specified framerate", false, "fps", true).validator(new IntValidator(1, 255)));
     options.addOption(Option("monitor-size", "M", "Split the image into multiple parts for large monitors", false, "WxH[@S]", false).validator(new RegExpValidator("^[0-9]+x[0-9]+(?:@[0-5](?:\\.5)?)?$")));
     options.addOption(Option("trim-borders", "", "For multi-monitor images, skip pixels that would be hidden underneath monitor borders, keeping the image size consistent"));
+    options.addOption(Option("decode-threads", "", "Number of threads to decode video with (0 = automatic)", false, "n", true).validator(new IntValidator(0, 256)));
+    options.addOption(Option("scale-threads", "", "Number of slices to scale each frame in parallel (0 = automatic)", false, "n", true).validator(new IntValidator(0, 256)));
+    options.addOption(Option("scaler", "", "Scaling algorithm to use when resizing; available modes: fast-bilinear|area|bicubic|lanczos", false, "mode", true).validator(new RegExpValidator("^(fast-bilinear|area|bicubic|lanczos)$")));
+    options.addOption(Option("segments", "", "Split 32vid videos into n parts that are encoded in parallel by separate processes", false, "n", true).validator(new IntValidator(1, 256)));
+    options.addOption(Option("shard", "", "Only encode part i of a 32vid video split into n parts, for merging with 32vid-merge later", false, "i/n", true).validator(new RegExpValidator("^[0-9]+/[0-9]+$")));
+    options.addOption(Option("resume", "", "Continue an interrupted 32vid encode from the checkpoint saved next to the output file (DFPWM audio may click where it resumes)"));
+    options.addOption(Option("cache", "", "Save converted frames in a directory, and reuse them when the same frame is converted with the same options again", false, "dir", true));
+    options.addOption(Option("ladder", "", "Also write a 32vid file at another size from the same decode, reusing the main output's palette; repeat for more sizes", false, "WxH:path", true).repeatable(true).validator(new RegExpValidator("^[0-9]+x[0-9]+:.+$")));
+    options.addOption(Option("batch", "", "Convert many files in one process: a manifest with an input and output path per line (separated by a tab), or a directory whose files are written into the -o directory", false, "file|dir", true));
+    options.addOption(Option("batch-jobs", "", "Split a batch between n worker processes that convert files at the same time", false, "n", true).validator(new IntValidator(1, 256)));
+    options.addOption(Option("device-pool", "", "Use every OpenCL device at once, giving each frame, or each multi-monitor tile, to whichever device is free next"));
+    options.addOption(Option("opencl-device", "", "Use the OpenCL device with the specified index or name instead of the fastest one", false, "index|name", true));
+    options.addOption(Option("list-devices", "", "List the available OpenCL devices and exit"));
+    options.addOption(Option("autotune", "", "Time each conversion stage on the CPU and OpenCL device with the first frame, and run each on the fastest one; results are cached for later runs"));
     options.addOption(Option("disable-opencl", "", "Disable OpenCL computation; force CPU-only"));
     options.addOption(Option("help", "h", "Show this help"));
     OptionProcessor argparse(options);
     argparse.setUnixStyle(true);
 
+    std::vector<std::string> segmentArgs, batchArgs;
+    std::vector<std::unique_ptr<ExtraOutput>> extraOutputs;
+    std::vector<LadderRung> ladder;
+    Checkpoint checkpoint;
     try {
         for (int i = 1; i < argc; i++) {
             std::string option, arg;
             if (argparse.process(argv[i], option, arg)) {
+                if (option != "output" && option != "resume") checkpoint.options += " --" + option + (arg.empty() ? "" : "=" + arg);
+                if (option != "output" && option != "resume" && option != "segments" && option != "start" && option != "duration") segmentArgs.push_back("--" + option + (arg.empty() ? "" : "=" + arg));
+                if (option != "input" && option != "output" && option != "batch" && option != "batch-jobs") batchArgs.push_back("--" + option + (arg.empty() ? "" : "=" + arg));
                 if (option == "input") input = arg;
                 else if (option == "subtitle") subtitle = arg;
                 else if (option == "format") format = arg;
-                else if (option == "output") output = arg;
+                else if (option == "output") {
+                    OutputType type = OutputType::Default;
+                    std::string path = arg;
+                    size_t pos = arg.find(':');
+                    if (pos != std::string::npos) {
+                        std::string fmt = arg.substr(0, pos);
+                        if (fmt == "lua") type = OutputType::Lua;
+                        else if (fmt == "nfp") type = OutputType::NFP;
+                        else if (fmt == "raw") type = OutputType::Raw;
+                        else if (fmt == "bimg") type = OutputType::BlitImage;
+                        else if (fmt == "32vid") type = OutputType::Vid32;
+                        if (type != OutputType::Default) path = arg.substr(pos + 1);
+                    }
+                    if (output.empty()) {
+                        output = path;
+                        if (type != OutputType::Default) mode = type;
+                    } else if (type == OutputType::Default) throw InvalidArgumentException("Additional outputs must start with a format (lua:, nfp:, raw:, bimg: or 32vid:).");
+                    else extraOutputs.push_back(std::unique_ptr<ExtraOutput>(new ExtraOutput(type, path)));
+                }
                 else if (option == "lua") mode = OutputType::Lua;
                 else if (option == "nfp") mode = OutputType::NFP;
                 else if (option == "raw") mode = OutputType::Raw;
@@ -573,12 +1414,23 @@ int main(int argc, const char * argv[]) {
                     else if (arg == "deflate") compression = VID32_FLAG_VIDEO_COMPRESSION_DEFLATE;
                     else if (arg == "custom") compression = VID32_FLAG_VIDEO_COMPRESSION_CUSTOM;
                 }
+                else if (option == "keyframe-interval") {
+                    keyframeInterval = std::stoi(arg);
+                    // The interval is also the index step, which is stored in one byte
+                    if (keyframeInterval < 0 || keyframeInterval > 255) throw InvalidArgumentException("Keyframe interval must be between 0 and 255.");
+                } else if (option == "keyframe-offset") {
+                    keyframeOffset = std::stoi(arg);
+                    if (keyframeOffset < 0) throw InvalidArgumentException("Keyframe offset must not be negative.");
+                }
                 else if (option == "binary") binary = true;
                 else if (option == "nfpize") nfpize = true;
                 else if (option == "dfpwm") useDFPWM = true;
                 else if (option == "mute") mute = true;
                 else if (option == "width") width = std::stoi(arg);
                 else if (option == "height") height = std::stoi(arg);
+                else if (option == "start") startTime = parseTimestamp(arg);
+                else if (option == "duration") clipDuration = parseTimestamp(arg);
+                else if (option == "fps") targetFPS = std::stoi(arg);
                 else if (option == "monitor-size") {
                     if (!arg.empty()) {
                         monitorArrayWidth = std::stoi(arg);
@@ -590,12 +1442,50 @@ int main(int argc, const char * argv[]) {
                     } else {monitorArrayWidth = 8; monitorArrayHeight = 6; monitorWidth = 328; monitorHeight = 243; monitorScale = 1;}
                 }
                 else if (option == "trim-borders") trimBorders = true;
+                else if (option == "decode-threads") decodeThreads = std::stoi(arg);
+                else if (option == "scale-threads") scaleThreads = std::stoi(arg);
+                else if (option == "scaler") {
+                    if (arg == "fast-bilinear") scaler = SWS_FAST_BILINEAR;
+                    else if (arg == "area") scaler = SWS_AREA;
+                    else if (arg == "bicubic") scaler = SWS_BICUBIC;
+                    else if (arg == "lanczos") scaler = SWS_LANCZOS;
+                }
+                else if (option == "segments") segments = std::stoi(arg);
+                else if (option == "shard") {
+                    shardIndex = std::stoi(arg);
+                    shardCount = std::stoi(arg.substr(arg.find('/') + 1));
+                    if (shardCount < 1 || shardIndex >= shardCount) throw InvalidArgumentException("Shard index must be between 0 and n-1.");
+                }
+                else if (option == "resume") resume = true;
+                else if (option == "cache") cacheDir = arg;
+                else if (option == "ladder") {
+                    int w = std::stoi(arg), h = std::stoi(arg.substr(arg.find('x') + 1));
+                    if (w < 2 || h < 3 || w > 65535 || h > 65535) throw InvalidArgumentException("Ladder sizes must be at least 2x3 pixels.");
+                    extraOutputs.push_back(std::unique_ptr<ExtraOutput>(new ExtraOutput(OutputType::Vid32, arg.substr(arg.find(':') + 1), w, h)));
+                    ladder.push_back(LadderRung {extraOutputs.back().get()});
+                }
+                else if (option == "batch") batchPath = arg;
+                else if (option == "batch-jobs") batchJobs = std::stoi(arg);
+                else if (option == "device-pool") useDevicePool = true;
+                else if (option == "opencl-device") openclDevice = arg;
+                else if (option == "list-devices") return listDevices();
+                else if (option == "autotune") autotune = true;
                 else if (option == "disable-opencl") disableOpenCL = true;
                 else if (option == "help") throw HelpException();
             }
         }
         argparse.checkRequired();
-        if (!(mode == OutputType::HTTP || mode == OutputType::WebSocket) && output == "") throw MissingOptionException("Required option not specified: output");
+        if (input.empty() && batchPath.empty()) throw MissingOptionException("Required option not specified: input");
+        if (!batchPath.empty() && (!input.empty() || !extraOutputs.empty() || segments > 1 || shardCount || resume || mode == OutputType::HTTP || mode == OutputType::WebSocket)) throw InvalidArgumentException("Batch mode cannot be combined with an input file, extra outputs, segmented encoding, resuming, or servers.");
+        if (!(mode == OutputType::HTTP || mode == OutputType::WebSocket) && output == "" && batchPath.empty()) throw MissingOptionException("Required option not specified: output");
+        if (segments > 1 && (mode != OutputType::Vid32 || separateStreams || output == "-")) throw InvalidArgumentException("Segmented encoding is only supported on 32vid files with combined streams.");
+        if (shardCount && (mode != OutputType::Vid32 || separateStreams || output == "-")) throw InvalidArgumentException("Sharded encoding is only supported on 32vid files with combined streams.");
+        if (keyframeInterval && (mode != OutputType::Vid32 || separateStreams || compression != VID32_FLAG_VIDEO_COMPRESSION_ANS)) throw InvalidArgumentException("Delta frames are only supported on 32vid files with combined streams and ANS compression.");
+        if ((segments > 1 || shardCount) && !subtitle.empty()) throw InvalidArgumentException("Subtitles are not supported with segmented encoding.");
+        if (resume && (mode != OutputType::Vid32 || separateStreams || output == "-" || segments > 1)) throw InvalidArgumentException("Resuming is only supported on 32vid files with combined streams, without --segments.");
+        if (!extraOutputs.empty() && (segments > 1 || shardCount || resume || monitorWidth)) throw InvalidArgumentException("Multiple outputs cannot be combined with segmented encoding, resuming, or monitor splitting.");
+        if (!ladder.empty() && (mode == OutputType::HTTP || mode == OutputType::WebSocket)) throw InvalidArgumentException("Ladder outputs are only supported when writing to a file.");
+        if (segments > 1 && shardCount) throw InvalidArgumentException("Segmented and sharded encoding cannot be combined.");
         if (monitorWidth && mode != OutputType::Default && mode != OutputType::Lua && mode != OutputType::BlitImage && !(mode == OutputType::Vid32 && !separateStreams)) throw InvalidArgumentException("Monitor splitting is only supported on Lua, BIMG, and 32vid outputs.");
     } catch (const OptionException &e) {
         if (e.className() != "HelpException") std::cerr << e.displayText() << "\n";
@@ -611,13 +1501,32 @@ int main(int argc, const char * argv[]) {
         help.setWidth(csbi.srWindow.Right - csbi.srWindow.Left + 1);
 #endif
         help.setUnixStyle(true);
-        help.setUsage("[options] -i <input> [-o <output> | -s <port> | -w <port> | -u <url>]");
+        help.setUsage("[options] (-i <input> | --batch <file|dir>) [-o <output> | -s <port> | -w <port> | -u <url>]");
         help.setCommand(argv[0]);
         help.setHeader("sanjuuni converts images and videos into a format that can be displayed in ComputerCraft.");
         help.setFooter("sanjuuni is licensed under the GPL license. Get the source at https://github.com/MCJack123/sanjuuni.");
         help.format(e.className() == "HelpException" ? std::cout : std::cerr);
         return e.className() != "HelpException";
     }
+    if (!batchPath.empty()) return runBatch(argv[0], batchArgs);
+#ifdef HAS_OPENCL
+    if (!disableOpenCL && !keepDevice) startDevice();
+#endif
+
+    bool extraAudio = false;
+    for (const auto& o : extraOutputs) if (o->mode == OutputType::Vid32 && !mute) extraAudio = true;
+    if (resume) {
+        Checkpoint saved;
+        if (!readCheckpoint(output + ".checkpoint", saved)) {
+            std::cerr << "Could not find a checkpoint for " << output << "; run again without --resume to start over\n";
+            return 1;
+        }
+        if (saved.options != checkpoint.options) {
+            std::cerr << "The checkpoint for " << output << " was made with different options\n";
+            return 1;
+        }
+        checkpoint = saved;
+    }
 
     if (useDFPWM) {
 #if (LIBAVCODEC_VERSION_MAJOR > 59 || (LIBAVCODEC_VERSION_MAJOR == 59 && LIBAVCODEC_VERSION_MINOR >= 22)) && \
@@ -642,7 +1551,8 @@ int main(int argc, const char * argv[]) {
     AVInputFormat * wanted_format = NULL;
 #endif
     const AVCodec * video_codec = NULL, * audio_codec = NULL, * dfpwm_codec = NULL;
-    SwsContext * resize_ctx = NULL;
+    std::vector<SwsContext*> resize_ctx, prescale_ctx;
+    AVFrame * prescaled = NULL;
     SwrContext * resample_ctx = NULL;
     const AVFilter * asetnsamples_filter = NULL, * src_filter = NULL, * sink_filter = NULL;
     AVFilterContext * asetnsamples_ctx = NULL, * src_ctx = NULL, * sink_ctx = NULL;
@@ -673,6 +1583,28 @@ int main(int argc, const char * argv[]) {
         avformat_close_input(&format_ctx);
         return 2;
     }
+    if (segments > 1) {
+        error = encodeSegments(format_ctx, video_stream, argv[0], segmentArgs);
+        avformat_close_input(&format_ctx);
+        return error;
+    } else if (shardCount) {
+        std::vector<int64_t> bounds = segmentBounds(format_ctx, video_stream, shardCount);
+        if (bounds.empty()) {
+            std::cerr << "Could not determine the length of the input, which is required for sharded encoding\n";
+            avformat_close_input(&format_ctx);
+            return 2;
+        }
+        if (bounds[shardIndex] == bounds[shardIndex+1]) {
+            // Leave an empty part behind so the merge knows this shard finished
+            std::cerr << "Shard " << shardIndex << "/" << shardCount << " does not contain any frames\n";
+            std::ofstream(output, std::ios::out | std::ios::binary);
+            avformat_close_input(&format_ctx);
+            return 0;
+        }
+        if (keyframeInterval) keyframeOffset = framesBefore(format_ctx, video_stream, bounds[0], bounds[shardIndex]);
+        startTime = bounds[shardIndex] / (double)AV_TIME_BASE;
+        clipDuration = (bounds[shardIndex+1] - bounds[shardIndex]) / (double)AV_TIME_BASE;
+    }
     // Open the video decoder
     if (!(video_codec = avcodec_find_decoder(format_ctx->streams[video_stream]->codecpar->codec_id))) {
         std::cerr << "Could not find video codec\n";
@@ -690,6 +1622,20 @@ int main(int argc, const char * argv[]) {
         avformat_close_input(&format_ctx);
         return error;
     }
+    video_codec_ctx->thread_count = decodeThreads;
+    video_codec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    if (width != -1 || height != -1) {
+        // For big downscales, ask the decoder to skip work that won't survive the resize
+        AVCodecParameters * par = format_ctx->streams[video_stream]->codecpar;
+        double downscale = width == -1 ? (double)par->height / height : height == -1 ? (double)par->width / width : min((double)par->width / width, (double)par->height / height);
+        if (downscale >= 4) {
+            int lowres = 0;
+            // keep at least twice the target resolution so the scaler still has something to filter
+            while (lowres < video_codec->max_lowres && downscale / (2 << lowres) >= 2) lowres++;
+            video_codec_ctx->lowres = lowres;
+            video_codec_ctx->skip_loop_filter = AVDISCARD_ALL;
+        }
+    }
     if ((error = avcodec_open2(video_codec_ctx, video_codec, NULL)) < 0) {
         std::cerr << "Could not open video codec: " << avErrorString(error) << "\n";
         avcodec_free_context(&video_codec_ctx);
@@ -697,7 +1643,7 @@ int main(int argc, const char * argv[]) {
         return error;
     }
     if (mode == OutputType::Default) mode = OutputType::Lua;
-    if (mode == OutputType::Vid32 && !separateStreams) {
+    if ((mode == OutputType::Vid32 && !separateStreams) || extraAudio) {
         if (!(filter_graph = avfilter_graph_alloc())) {
             std::cerr << "Could not allocate filter graph\n";
             avcodec_free_context(&video_codec_ctx);
@@ -901,7 +1847,16 @@ int main(int argc, const char * argv[]) {
 
     std::ofstream outfile;
     if (output != "-" && output != "" && mode != OutputType::WebSocket) {
-        outfile.open(output, std::ios::out | std::ios::binary);
+        if (resume) {
+            // Drop anything written after the checkpoint, and continue from there
+            try {
+                Poco::File(output).setSize(checkpoint.offset);
+                outfile.open(output, std::ios::in | std::ios::out | std::ios::binary);
+                outfile.seekp(checkpoint.offset);
+            } catch (Poco::Exception &e) {
+                std::cerr << "Could not truncate output file: " << e.displayText() << "\n";
+            }
+        } else outfile.open(output, std::ios::out | std::ios::binary);
         if (!outfile.good()) {
             std::cerr << "Could not open output file!\n";
             av_frame_free(&frame);
@@ -925,14 +1880,138 @@ int main(int argc, const char * argv[]) {
     SDL_Window * win = NULL;
 #endif
     std::string videoStream;
+    std::unique_ptr<FramePool<uchar3>> framePool;
+    std::vector<std::unique_ptr<FramePool<uchar3>>> deviceFramePools; // frames for each --device-pool device, so their buffers are kept too
     std::vector<Vid32SubtitleEvent*> vid32subs;
     std::stringstream vid32stream;
+    Vid32StreamState vid32state;
     double fps = 0;
     int nframe = 0, nframe_vid32 = 0;
     auto start = system_clock::now();
     auto lastUpdate = system_clock::now() - seconds(1);
     bool first = true;
-    int64_t totalDuration = 0;
+    int64_t totalDuration = 0, decimationStart = AV_NOPTS_VALUE, lastSlot = -1;
+    bool decimate = false, videoDone = false, audioDone = true;
+    const bool primaryAudio = mode != OutputType::Lua && mode != OutputType::Raw && mode != OutputType::BlitImage && mode != OutputType::NFP && !mute;
+    const bool hasAudio = audio_stream >= 0 && (primaryAudio || extraAudio);
+    // Clip bounds are in AV_TIME_BASE units, relative to the start of the input
+    const bool clipping = startTime > 0 || clipDuration > 0 || resume;
+    const int64_t inputStart = format_ctx->start_time != AV_NOPTS_VALUE ? format_ctx->start_time : 0;
+    const int64_t clipStart = llround(startTime * AV_TIME_BASE), clipEnd = clipStart + llround(clipDuration * AV_TIME_BASE);
+    int64_t videoStart = clipStart, audioStart = clipStart, audioSamples = 0;
+    const bool checkpoints = mode == OutputType::Vid32 && !separateStreams && outfile.is_open();
+    auto lastCheckpoint = system_clock::now();
+    if (resume) {
+        nframe = checkpoint.frames;
+        nframe_vid32 = checkpoint.chunks;
+        vid32state.nvideo = checkpoint.videoFrames;
+        vid32state.index = checkpoint.index;
+        totalDuration = checkpoint.duration;
+        decimationStart = checkpoint.decimationStart;
+        lastSlot = checkpoint.lastSlot;
+        videoStart = max(checkpoint.video, clipStart);
+        audioSamples = checkpoint.samples;
+        audioStart = clipStart + av_rescale(audioSamples, AV_TIME_BASE, 48000);
+    }
+    // Frames are written out once they're done converting, in order, so the devices convert the next frames while the
+    // last ones are encoded and written; this finishes and writes the oldest frames until at most left are still converting
+    std::deque<PendingFrame> pendingFrames;
+    auto finishFrames = [&](size_t left) -> bool {
+        while (pendingFrames.size() > left) {
+            PendingFrame& pending = pendingFrames.front();
+            finishConvertImage(pending.image);
+            uchar *characters = pending.image.characters, *colors = pending.image.colors;
+            std::vector<Vec3b>& palette = pending.image.palette;
+            size_t w = pending.image.width, h = pending.image.height;
+            switch (mode) {
+            case OutputType::Lua: {
+                outstream << makeLuaFile(characters, colors, palette, w / 2, h / 3) << "sleep(" << pending.duration << ")\n";
+                outstream.flush();
+                break;
+            } case OutputType::NFP: {
+                outstream << makeNFP(characters, colors, palette, w / 2, h / 3);
+                outstream.flush();
+                break;
+            } case OutputType::Raw: {
+                outstream << makeRawImage(characters, colors, palette, w / 2, h / 3);
+                outstream.flush();
+                break;
+            } case OutputType::BlitImage: {
+                outstream << makeTable(characters, colors, palette, w / 2, h / 3, binary, true, binary) << (binary ? "," : ",\n");
+                outstream.flush();
+                break;
+            } case OutputType::Vid32: {
+                if (separateStreams) {
+                    if (compression == VID32_FLAG_VIDEO_COMPRESSION_CUSTOM) videoStream += make32vid_cmp(characters, colors, palette, w / 2, h / 3);
+                    else if (compression == VID32_FLAG_VIDEO_COMPRESSION_ANS) videoStream += make32vid_ans(characters, colors, palette, w / 2, h / 3);
+                    else videoStream += make32vid(characters, colors, palette, w / 2, h / 3);
+                    renderSubtitles(subtitles, pending.nframe, NULL, NULL, palette, w, h, &vid32subs);
+                } else {
+                    Vid32Chunk::Type type;
+                    std::string data = make32vidFrame(characters, colors, palette, w / 2, h / 3, &vid32state, &type);
+                    if (data.empty()) {
+                        std::cerr << "Could not compress video!\n";
+                        return false;
+                    }
+                    vid32state.mark(vid32stream);
+                    uint32_t size = data.size();
+                    vid32stream.write((const char*)&size, 4);
+                    vid32stream.put((char)type);
+                    vid32stream.write(data.c_str(), data.size());
+                    nframe_vid32++;
+                    std::vector<Vid32SubtitleEvent*> subs;
+                    renderSubtitles(subtitles, pending.nframe, NULL, NULL, palette, w, h, &subs);
+                    for (Vid32SubtitleEvent * sub : subs) {
+                        size = sizeof(Vid32SubtitleEvent) + sub->size;
+                        vid32stream.write((const char*)&size, 4);
+                        vid32stream.put((char)Vid32Chunk::Type::Subtitle);
+                        vid32stream.write((char*)sub, size);
+                        free(sub);
+                        nframe_vid32++;
+                    }
+                }
+                break;
+            } case OutputType::HTTP: case OutputType::WebSocket: {
+                frameStorage.push_back("return " + makeTable(characters, colors, palette, w / 2, h / 3, true));
+                break;
+            }
+            }
+            if (!extraOutputs.empty()) {
+                auto img = std::make_shared<const CCFrame>(characters, colors, palette, w / 2, h / 3, pending.duration);
+                for (const auto& o : extraOutputs) if (!o->width) o->writeFrame(img);
+                for (size_t i = 0; i < ladder.size(); i++) {
+                    LadderRung& rung = ladder[i];
+                    std::shared_ptr<Mat> rrs = pending.rungs[i];
+                    if (!rrs) continue;
+                    uchar *rchars = NULL, *rcols;
+                    std::vector<Vec3b> rpal;
+                    size_t rw, rh;
+                    convertImage(*rrs, &rchars, &rcols, rpal, rw, rh, pending.nframe, &palette);
+                    rung.output->writeFrame(std::make_shared<const CCFrame>(rchars, rcols, rpal, rw / 2, rh / 3, pending.duration));
+                    if (rchars) delete[] rchars;
+                    delete[] rcols;
+                }
+            }
+#ifdef USE_SDL
+            if (!win) win = SDL_CreateWindow("Image", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, width, height, SDL_WINDOW_SHOWN);
+            SDL_Surface * surf = SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_BGRA32);
+            for (int i = 0; i < out.vec.size(); i++) ((uint32_t*)surf->pixels)[i] = 0xFF000000 | (out.vec[i].z << 16) | (out.vec[i].y << 8) | out.vec[i].x;
+            SDL_BlitSurface(surf, NULL, SDL_GetWindowSurface(win), NULL);
+            SDL_FreeSurface(surf);
+            SDL_UpdateWindowSurface(win);
+#endif
+            if (characters) delete[] characters;
+            delete[] colors;
+            pendingFrames.pop_front();
+        }
+        return true;
+    };
+    for (const auto& o : extraOutputs) {
+        if (!o->open()) {
+            std::cerr << "Could not open output file " << o->path << "!\n";
+            goto cleanup;
+        }
+    }
 #ifndef NO_NET
     if (mode == OutputType::HTTP) {
         srv = new HTTPServer(new HTTPListener::Factory(&fps), port);
@@ -985,41 +2064,6 @@ int main(int argc, const char * argv[]) {
     }
 #endif
 
-#ifdef HAS_OPENCL
-    if (!disableOpenCL) {
-        try {
-            device = new OpenCL::Device(OpenCL::select_device_with_most_flops());
-            /*Mat testImage(2, 2, device);
-            testImage.at(0, 0) = {255, 0, 0};
-            testImage.at(0, 1) = {255, 255, 0};
-            testImage.at(1, 0) = {0, 255, 0};
-            testImage.at(1, 1) = {0, 0, 255};
-            Mat expected = ditherImage_ordered(testImage, {{255, 192, 128}, {0, 64, 96}}, NULL);
-            Mat actual = ditherImage_ordered(testImage, {{255, 192, 128}, {0, 64, 96}}, device);
-            expected.download();
-            actual.download();
-            printf("%d %d %d => %d %d %d / %d %d %d\n",
-                testImage.at(0, 0).x, testImage.at(0, 0).y, testImage.at(0, 0).z,
-                expected.at(0, 0).x, expected.at(0, 0).y, expected.at(0, 0).z,
-                actual.at(0, 0).x, actual.at(0, 0).y, actual.at(0, 0).z);
-            printf("%d %d %d => %d %d %d / %d %d %d\n",
-                testImage.at(0, 1).x, testImage.at(0, 1).y, testImage.at(0, 1).z,
-                expected.at(0, 1).x, expected.at(0, 1).y, expected.at(0, 1).z,
-                actual.at(0, 1).x, actual.at(0, 1).y, actual.at(0, 1).z);
-            printf("%d %d %d => %d %d %d / %d %d %d\n",
-                testImage.at(1, 0).x, testImage.at(1, 0).y, testImage.at(1, 0).z,
-                expected.at(1, 0).x, expected.at(1, 0).y, expected.at(1, 0).z,
-                actual.at(1, 0).x, actual.at(1, 0).y, actual.at(1, 0).z);
-            printf("%d %d %d => %d %d %d / %d %d %d\n",
-                testImage.at(1, 1).x, testImage.at(1, 1).y, testImage.at(1, 1).z,
-                expected.at(1, 1).x, expected.at(1, 1).y, expected.at(1, 1).z,
-                actual.at(1, 1).x, actual.at(1, 1).y, actual.at(1, 1).z);*/
-        } catch (std::exception &e) {
-            std::cerr << "Warning: Could not open OpenCL device: " << e.what() << ". Falling back to CPU computation.\n";
-            device = NULL;
-        }
-    }
-#endif
 
 #ifdef USE_SDL
     SDL_SetHint(SDL_HINT_VIDEO_X11_NET_WM_BYPASS_COMPOSITOR, "0");
@@ -1027,22 +2071,51 @@ int main(int argc, const char * argv[]) {
 #endif
 
     totalFrames = format_ctx->streams[video_stream]->nb_frames;
+    if (min(videoStart, audioStart) > 0) {
+        // Seek to the keyframe before the start; the frames up to the exact start are decoded and discarded below
+        if ((error = avformat_seek_file(format_ctx, -1, INT64_MIN, inputStart + min(videoStart, audioStart), inputStart + min(videoStart, audioStart), 0)) < 0)
+            std::cerr << "Warning: Could not seek to start time, decoding from the beginning: " << avErrorString(error) << "\n";
+    }
+    if (clipDuration > 0) audioDone = !hasAudio;
     while (av_read_frame(format_ctx, packet) >= 0) {
-        if (packet->stream_index == video_stream) {
+        if (packet->stream_index == video_stream && !videoDone) {
             avcodec_send_packet(video_codec_ctx, packet);
             fps = av_q2d(video_codec_ctx->framerate);
+            if (targetFPS && (fps < 1 || fps > targetFPS)) {
+                if (first && fps >= 1) totalFrames = totalFrames * targetFPS / fps;
+                fps = targetFPS;
+                decimate = true;
+            }
             /*if (fps < 1 && format_ctx->streams[video_stream]->nb_frames > 1) {
                 std::cerr << "Variable framerate files are not supported.\n";
                 av_packet_unref(packet);
                 goto cleanup;
             }*/
             if (first) {
+                if (clipping && fps >= 1) totalFrames = clipDuration > 0 ? clipDuration * fps : max(totalFrames - (long)(startTime * fps), 0L);
                 if (!subtitle.empty()) subtitles = parseASSSubtitles(subtitle, fps);
                 if (mode == OutputType::Raw) outstream << "32Vid 1.1\n" << fps << "\n";
                 else if (mode == OutputType::BlitImage) outstream << (binary ? "{" : "{\n");
                 first = false;
             }
             while ((error = avcodec_receive_frame(video_codec_ctx, frame)) == 0) {
+                if (clipping && frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+                    int64_t t = av_rescale_q(frame->best_effort_timestamp, format_ctx->streams[video_stream]->time_base, AVRational{1, AV_TIME_BASE}) - inputStart;
+                    if (t < videoStart) continue;
+                    if (clipDuration > 0 && t >= clipEnd) {
+                        videoDone = true;
+                        error = AVERROR_EOF;
+                        break;
+                    }
+                }
+                if (decimate && frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+                    // Only keep the first frame shown in each output frame interval
+                    if (decimationStart == AV_NOPTS_VALUE) decimationStart = frame->best_effort_timestamp;
+                    int64_t slot = floor((frame->best_effort_timestamp - decimationStart) * av_q2d(format_ctx->streams[video_stream]->time_base) * targetFPS + 0.000001);
+                    if (slot <= lastSlot) continue;
+                    lastSlot = slot;
+                }
+                if (frame->best_effort_timestamp != AV_NOPTS_VALUE) checkpoint.video = av_rescale_q(frame->best_effort_timestamp, format_ctx->streams[video_stream]->time_base, AVRational{1, AV_TIME_BASE}) - inputStart + 1;
                 auto now = system_clock::now();
                 if (now - lastUpdate > milliseconds(250)) {
                     auto t = now - start;
@@ -1055,7 +2128,9 @@ int main(int argc, const char * argv[]) {
                     lastUpdate = now;
                 } else nframe++;
                 totalDuration += frame->duration;
-                if (resize_ctx == NULL) {
+                // When decimating, each kept frame stays on screen for a whole output frame interval
+                const double frameDuration = decimate ? 1.0 / targetFPS : frame->duration * av_q2d(format_ctx->streams[video_stream]->time_base);
+                if (resize_ctx.empty()) {
                     if (width != -1 || height != -1) {
                         width = width == -1 ? height * ((double)frame->width / (double)frame->height) : width;
                         height = height == -1 ? width * ((double)frame->height / (double)frame->width) : height;
@@ -1069,7 +2144,34 @@ int main(int argc, const char * argv[]) {
                     } else if (monitorWidth && mode == OutputType::Lua) {
                         outstream << "local width,height=" << ceil((double)width / (double)monitorWidth) << "," << ceil((double)height / (double)monitorHeight) << ";" << multiMonitorLua;
                     }
-                    resize_ctx = sws_getContext(frame->width, frame->height, (AVPixelFormat)frame->format, width, height, AV_PIX_FMT_BGR24, SWS_BICUBIC, NULL, NULL, NULL);
+                    int slices = scaleSliceCount(height);
+                    int srcWidth = frame->width, srcHeight = frame->height;
+                    if ((scaler == SWS_BICUBIC || scaler == SWS_LANCZOS) && srcWidth >= width * 4 && srcHeight >= height * 4) {
+                        // Filtering a huge frame down is slow, so cheaply average it to twice the target size first
+                        prescaled = av_frame_alloc();
+                        prescaled->width = srcWidth = width * 2;
+                        prescaled->height = srcHeight = height * 2;
+                        prescaled->format = frame->format;
+                        if ((error = av_frame_get_buffer(prescaled, 0)) < 0) {
+                            std::cerr << "Could not allocate scaling buffer: " << avErrorString(error) << "\n";
+                            goto cleanup;
+                        }
+                        int preslices = max(min(slices, srcHeight / 16), 1);
+                        for (int i = 0; i < preslices; i++) prescale_ctx.push_back(sws_getContext(frame->width, frame->height, (AVPixelFormat)frame->format, srcWidth, srcHeight, (AVPixelFormat)frame->format, SWS_AREA, NULL, NULL, NULL));
+                    }
+                    for (int i = 0; i < slices; i++) resize_ctx.push_back(sws_getContext(srcWidth, srcHeight, (AVPixelFormat)frame->format, width, height, AV_PIX_FMT_BGR24, scaler, NULL, NULL, NULL));
+                    for (LadderRung& rung : ladder) {
+                        // Shrink from the main output's image when possible, so the full-size frame is only filtered once
+                        int rw = rung.output->width, rh = rung.output->height;
+                        rung.fromSource = rw > width || rh > height;
+                        int rslices = scaleSliceCount(rh);
+                        for (int i = 0; i < rslices; i++) {
+                            if (rung.fromSource) rung.resize_ctx.push_back(sws_getContext(frame->width, frame->height, (AVPixelFormat)frame->format, rw, rh, AV_PIX_FMT_BGR24, scaler, NULL, NULL, NULL));
+                            else rung.resize_ctx.push_back(sws_getContext(width, height, AV_PIX_FMT_BGR24, rw, rh, AV_PIX_FMT_BGR24, scaler, NULL, NULL, NULL));
+                        }
+                        rung.framePool = std::unique_ptr<FramePool<uchar3>>(new FramePool<uchar3>(rw, rh, device, rw));
+                    }
+                    for (const auto& o : extraOutputs) o->start(width, height, fps);
                     if (mode == OutputType::Vid32 && !separateStreams) {
                         Vid32Chunk combinedChunk;
                         Vid32Header header;
@@ -1087,140 +2189,175 @@ int main(int argc, const char * argv[]) {
                                 VID32_FLAG_VIDEO_MULTIMONITOR_WIDTH(width / (trimBorders ? monitorArrayWidth * 128 / monitorScale / 3 : monitorWidth)) |
                                 VID32_FLAG_VIDEO_MULTIMONITOR_HEIGHT(height / (trimBorders ? monitorArrayHeight * 128 / monitorScale / 3 : monitorHeight));
                         }
-                        outstream.write((char*)&header, 12);
-                        outstream.write((char*)&combinedChunk, 9);
+                        if (!resume) {
+                            outstream.write((char*)&header, 12);
+                            outstream.write((char*)&combinedChunk, 9);
+                        }
+                        // The index is written at the end, so only files can be indexed; a part whose full frames are offset
+                        // from its own start can't be indexed on its own, but merging it indexes the whole video
+                        vid32state.offset = keyframeOffset;
+                        if (outfile.is_open() && !(keyframeInterval && keyframeOffset % keyframeInterval)) vid32state.indexStep = indexStepFor(fps);
                     }
                 }
-                Mat rs(width, height+1, device);
-                uint8_t * data = (uint8_t*)rs.vec.data();
-                int stride[3] = {width * 3, width * 3, width * 3};
-                uint8_t * ptrs[3] = {data, data + 1, data + 2};
-                sws_scale(resize_ctx, frame->data, frame->linesize, 0, frame->height, ptrs, stride);
-                rs.remove_last_line();
-                if (monitorWidth) {
-                    for (int y = 0, my = 1; y < height; my++, y += (trimBorders ? monitorArrayHeight * 128 / monitorScale / 3 : monitorHeight)) {
-                        for (int x = 0, mx = 1; x < width; mx++, x += (trimBorders ? monitorArrayWidth * 128 / monitorScale / 3 : monitorWidth)) {
-                            int mw = min(width - x, monitorWidth), mh = min(height - y, monitorHeight);
-                            Mat crop(mw, mh, device);
-                            for (int line = 0; line < mh; line++) {
-                                memcpy(crop.vec.data() + line * mw, rs.vec.data() + (y + line) * width + x, mw * sizeof(uchar3));
-                            }
-                            uchar *characters = NULL, *colors;
-                            std::vector<Vec3b> palette;
-                            size_t w, h;
-                            convertImage(crop, &characters, &colors, palette, w, h, nframe);
-                            if (mode == OutputType::Lua) outstream << "do local m,i,p=peripheral.wrap(monitors[" << my << "][" << mx << "])," << makeTable(characters, colors, palette, w / 2, h / 3, true) << "m.clear()m.setTextScale(" << (monitorScale / 2.0) << ")for i=0,#p do m.setPaletteColor(2^i,table.unpack(p[i]))end for y,r in ipairs(i)do m.setCursorPos(1,y)m.blit(table.unpack(r))end end\n";
-                            else if (mode == OutputType::BlitImage) outstream << makeTable(characters, colors, palette, w / 2, h / 3, binary, true, binary) << (binary ? "," : ",\n");
-                            else if (mode == OutputType::Vid32) {
-                                std::string data;
-                                if (compression == VID32_FLAG_VIDEO_COMPRESSION_CUSTOM) data = make32vid_cmp(characters, colors, palette, w / 2, h / 3);
-                                else if (compression == VID32_FLAG_VIDEO_COMPRESSION_ANS) data = make32vid_ans(characters, colors, palette, w / 2, h / 3);
-                                else data = make32vid(characters, colors, palette, w / 2, h / 3);
-                                if (compression == VID32_FLAG_VIDEO_COMPRESSION_DEFLATE) {
-                                    unsigned long size = compressBound(videoStream.size());
-                                    uint8_t * buf = new uint8_t[size];
-                                    error = compress2(buf, &size, (const uint8_t*)videoStream.c_str(), videoStream.size(), compression);
-                                    if (error != Z_OK) {
-                                        std::cerr << "Could not compress video!\n";
-                                        delete[] buf;
-                                        goto cleanup;
-                                    }
-                                    data = std::string((const char*)buf + 2, size - 6);
-                                    delete[] buf;
-                                }
-                                uint32_t size = data.size();
-                                vid32stream.write((const char*)&size, 4);
-                                vid32stream.put((char)Vid32Chunk::Type::MultiMonitorVideo | ((mx - 1) << 3) | (my - 1));
-                                uint16_t tmp = w / 2;
-                                vid32stream.write((char*)&tmp, 2);
-                                tmp = h / 3;
-                                vid32stream.write((char*)&tmp, 2);
-                                vid32stream.write(data.c_str(), data.size());
-                                nframe_vid32++;
+#ifdef HAS_OPENCL
+                if (takeDevice()) {
+                    // Buffers made before the device was ready have no device memory, so make new ones once the frames using them are written
+                    if (!finishFrames(0)) goto cleanup;
+                    framePool.reset();
+                    for (LadderRung& rung : ladder) if (rung.framePool) rung.framePool = std::unique_ptr<FramePool<uchar3>>(new FramePool<uchar3>(rung.output->width, rung.output->height, device, rung.output->width));
+                }
+#endif
+                size_t frameDevice = 0;
+                int frameSlot = 0;
+                if (!monitorWidth) {
+                    // Give the frame to the device with the least work left that has a free result slot, like monitor tiles;
+                    // if every slot is taken, write out the oldest frame to free its slot
+                    size_t ndevices = device != NULL ? devicePool.size() + 1 : 1;
+                    if (deviceFramePools.size() < ndevices - 1) deviceFramePools.resize(ndevices - 1);
+                    for (;;) {
+                        int best = -1, bestLoad = 0;
+                        for (size_t d = 0; d < ndevices; d++) {
+                            bool used[2] = {false, false};
+                            int load = 0;
+                            for (const PendingFrame& p : pendingFrames) {
+                                if (p.device != d) continue;
+                                used[p.slot] = true;
+                                if (!p.image.conversion.ready()) load++;
                             }
-                            outstream.flush();
-                            if (characters) delete[] characters;
-                            delete[] colors;
+                            if (used[0] && used[1]) continue;
+                            if (best < 0 || load < bestLoad) {best = d; bestLoad = load; frameSlot = used[0] ? 1 : 0;}
+                        }
+                        if (best >= 0) {
+                            frameDevice = best;
+                            break;
                         }
+                        if (!finishFrames(pendingFrames.size() - 1)) goto cleanup;
                     }
-                    // TODO: subtitles?
+                }
+                OpenCL::Device * frameDev = frameDevice ? devicePool[frameDevice - 1] : device;
+                std::shared_ptr<Mat> rs;
+                if (frame->width == width && frame->height == height && frame->format == AV_PIX_FMT_BGR24 && frame->linesize[0] % sizeof(uchar3) == 0) {
+                    // Already in the right format, so just view the decoded frame directly
+                    AVFrame * ref = av_frame_clone(frame);
+                    std::shared_ptr<void> owner(ref, [](void* f) {av_frame_free((AVFrame**)&f);});
+                    rs = std::make_shared<Mat>((uchar3*)ref->data[0], width, height, ref->linesize[0] / sizeof(uchar3), owner, frameDev);
                 } else {
-                    uchar *characters = NULL, *colors;
-                    std::vector<Vec3b> palette;
-                    size_t w, h;
-                    convertImage(rs, &characters, &colors, palette, w, h, nframe);
-                    switch (mode) {
-                    case OutputType::Lua: {
-                        outstream << makeLuaFile(characters, colors, palette, w / 2, h / 3) << "sleep(" << (frame->duration * av_q2d(format_ctx->streams[video_stream]->time_base)) << ")\n";
-                        outstream.flush();
-                        break;
-                    } case OutputType::NFP: {
-                        outstream << makeNFP(characters, colors, palette, w / 2, h / 3);
-                        outstream.flush();
-                        break;
-                    } case OutputType::Raw: {
-                        outstream << makeRawImage(characters, colors, palette, w / 2, h / 3);
-                        outstream.flush();
-                        break;
-                    } case OutputType::BlitImage: {
-                        outstream << makeTable(characters, colors, palette, w / 2, h / 3, binary, true, binary) << (binary ? "," : ",\n");
-                        outstream.flush();
-                        break;
-                    } case OutputType::Vid32: {
-                        if (separateStreams) {
-                            if (compression == VID32_FLAG_VIDEO_COMPRESSION_CUSTOM) videoStream += make32vid_cmp(characters, colors, palette, w / 2, h / 3);
-                            else if (compression == VID32_FLAG_VIDEO_COMPRESSION_ANS) videoStream += make32vid_ans(characters, colors, palette, w / 2, h / 3);
-                            else videoStream += make32vid(characters, colors, palette, w / 2, h / 3);
-                            renderSubtitles(subtitles, nframe, NULL, NULL, palette, w, h, &vid32subs);
-                        } else {
-                            std::string data;
-                            if (compression == VID32_FLAG_VIDEO_COMPRESSION_CUSTOM) data = make32vid_cmp(characters, colors, palette, w / 2, h / 3);
-                            else if (compression == VID32_FLAG_VIDEO_COMPRESSION_ANS) data = make32vid_ans(characters, colors, palette, w / 2, h / 3);
-                            else data = make32vid(characters, colors, palette, w / 2, h / 3);
-                            if (compression == VID32_FLAG_VIDEO_COMPRESSION_DEFLATE) {
-                                unsigned long size = compressBound(videoStream.size());
-                                uint8_t * buf = new uint8_t[size];
-                                error = compress2(buf, &size, (const uint8_t*)videoStream.c_str(), videoStream.size(), compression);
-                                if (error != Z_OK) {
-                                    std::cerr << "Could not compress video!\n";
-                                    delete[] buf;
-                                    goto cleanup;
-                                }
-                                data = std::string((const char*)buf + 2, size - 6);
-                                delete[] buf;
+                    std::unique_ptr<FramePool<uchar3>>& pool = frameDevice ? deviceFramePools[frameDevice - 1] : framePool;
+                    if (!pool) pool = std::unique_ptr<FramePool<uchar3>>(new FramePool<uchar3>(width, height, frameDev, width));
+                    rs = pool->acquire();
+                    if ((error = scaleFrame(resize_ctx, frame, *rs, prescale_ctx, prescaled)) < 0) {
+                        std::cerr << "Could not scale frame: " << avErrorString(error) << "\n";
+                        continue;
+                    }
+                }
+                if (monitorWidth) {
+                    std::deque<MonitorTile> tiles;
+                    for (int y = 0, my = 1; y < height; my++, y += (trimBorders ? monitorArrayHeight * 128 / monitorScale / 3 : monitorHeight))
+                        for (int x = 0, mx = 1; x < width; mx++, x += (trimBorders ? monitorArrayWidth * 128 / monitorScale / 3 : monitorWidth))
+                            tiles.emplace_back(mx, my, x, y, min(width - x, monitorWidth), min(height - y, monitorHeight));
+                    std::vector<OpenCL::Device*> devices {device};
+                    if (device != NULL) devices.insert(devices.end(), devicePool.begin(), devicePool.end());
+                    std::vector<std::array<bool, 2>> busy(devices.size(), {false, false});
+                    size_t next = 0;
+                    for (size_t i = 0; i < tiles.size(); i++) {
+                        // Keep up to two tiles queued on each device, giving the next one to the device with the least work left;
+                        // the device uploads and converts them while earlier tiles are written out in order
+                        while (next < tiles.size()) {
+                            int best = -1, bestLoad = 0;
+                            for (size_t d = 0; d < devices.size(); d++) {
+                                if (busy[d][0] && busy[d][1]) continue;
+                                int load = 0;
+                                for (size_t j = i; j < next; j++) if (tiles[j].device == d && !tiles[j].image.conversion.ready()) load++;
+                                if (best < 0 || load < bestLoad) {best = d; bestLoad = load;}
                             }
+                            if (best < 0) break;
+                            MonitorTile& tile = tiles[next++];
+                            tile.device = best;
+                            tile.slot = busy[best][0] ? 1 : 0;
+                            busy[best][tile.slot] = true;
+                            tile.crop = rs->view(tile.x, tile.y, tile.width, tile.height, devices[best]);
+                            startConvertImage(tile.crop, tile.image, nframe, tile.slot, NULL, devices[best]);
+                        }
+                        finishConvertImage(tiles[i].image);
+                        busy[tiles[i].device][tiles[i].slot] = false;
+                        int mx = tiles[i].mx, my = tiles[i].my;
+                        uchar *characters = tiles[i].image.characters, *colors = tiles[i].image.colors;
+                        std::vector<Vec3b>& palette = tiles[i].image.palette;
+                        size_t w = tiles[i].image.width, h = tiles[i].image.height;
+                        if (mode == OutputType::Lua) outstream << "do local m,i,p=peripheral.wrap(monitors[" << my << "][" << mx << "])," << makeTable(characters, colors, palette, w / 2, h / 3, true) << "m.clear()m.setTextScale(" << (monitorScale / 2.0) << ")for i=0,#p do m.setPaletteColor(2^i,table.unpack(p[i]))end for y,r in ipairs(i)do m.setCursorPos(1,y)m.blit(table.unpack(r))end end\n";
+                        else if (mode == OutputType::BlitImage) outstream << makeTable(characters, colors, palette, w / 2, h / 3, binary, true, binary) << (binary ? "," : ",\n");
+                        else if (mode == OutputType::Vid32) {
+                            std::string data = make32vidFrame(characters, colors, palette, w / 2, h / 3);
+                            if (data.empty()) {
+                                std::cerr << "Could not compress video!\n";
+                                goto cleanup;
+                            }
+                            if (mx == 1 && my == 1) vid32state.mark(vid32stream);
                             uint32_t size = data.size();
                             vid32stream.write((const char*)&size, 4);
-                            vid32stream.put((char)Vid32Chunk::Type::Video);
+                            vid32stream.put((char)Vid32Chunk::Type::MultiMonitorVideo | ((mx - 1) << 3) | (my - 1));
+                            uint16_t tmp = w / 2;
+                            vid32stream.write((char*)&tmp, 2);
+                            tmp = h / 3;
+                            vid32stream.write((char*)&tmp, 2);
                             vid32stream.write(data.c_str(), data.size());
                             nframe_vid32++;
-                            std::vector<Vid32SubtitleEvent*> subs;
-                            renderSubtitles(subtitles, nframe, NULL, NULL, palette, w, h, &subs);
-                            for (Vid32SubtitleEvent * sub : subs) {
-                                size = sizeof(Vid32SubtitleEvent) + sub->size;
-                                vid32stream.write((const char*)&size, 4);
-                                vid32stream.put((char)Vid32Chunk::Type::Subtitle);
-                                vid32stream.write((char*)sub, size);
-                                free(sub);
-                                nframe_vid32++;
-                            }
                         }
-                        break;
-                    } case OutputType::HTTP: case OutputType::WebSocket: {
-                        frameStorage.push_back("return " + makeTable(characters, colors, palette, w / 2, h / 3, true));
-                        break;
+                        outstream.flush();
+                        if (characters) delete[] characters;
+                        delete[] colors;
                     }
+                    // TODO: subtitles?
+                } else {
+                    pendingFrames.emplace_back();
+                    PendingFrame& pending = pendingFrames.back();
+                    pending.rs = rs;
+                    pending.nframe = nframe;
+                    pending.duration = frameDuration;
+                    if (!extraOutputs.empty()) {
+                        // Ladder rungs are scaled while the decoded frame is still around, and converted when the frame is written
+                        for (LadderRung& rung : ladder) {
+                            std::shared_ptr<Mat> rrs = rung.framePool->acquire();
+                            if (rung.fromSource) error = scaleFrame(rung.resize_ctx, frame, *rrs);
+                            else {
+                                AVFrame * src = frameForMat(*rs);
+                                error = scaleFrame(rung.resize_ctx, src, *rrs);
+                                av_frame_free(&src);
+                            }
+                            if (error < 0) {
+                                std::cerr << "Could not scale frame for " << rung.output->path << ": " << avErrorString(error) << "\n";
+                                rrs.reset();
+                            }
+                            pending.rungs.push_back(rrs);
+                        }
                     }
-#ifdef USE_SDL
-                    if (!win) win = SDL_CreateWindow("Image", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, width, height, SDL_WINDOW_SHOWN);
-                    SDL_Surface * surf = SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_BGRA32);
-                    for (int i = 0; i < out.vec.size(); i++) ((uint32_t*)surf->pixels)[i] = 0xFF000000 | (out.vec[i].z << 16) | (out.vec[i].y << 8) | out.vec[i].x;
-                    SDL_BlitSurface(surf, NULL, SDL_GetWindowSurface(win), NULL);
-                    SDL_FreeSurface(surf);
-                    SDL_UpdateWindowSurface(win);
-#endif
-                    if (characters) delete[] characters;
-                    delete[] colors;
+                    pending.device = frameDevice;
+                    pending.slot = frameSlot;
+                    startConvertImage(*rs, pending.image, nframe, frameSlot, NULL, frameDev);
+                    // Streamed servers send each frame as soon as it's converted; otherwise, write out the frames that are done
+                    if (streamed) {
+                        if (!finishFrames(0)) goto cleanup;
+                    } else while (!pendingFrames.empty() && pendingFrames.front().image.conversion.ready())
+                        if (!finishFrames(pendingFrames.size() - 1)) goto cleanup;
+                }
+                if (checkpoints && !hasAudio && nframe % max((int)fps, 1) == 0 && system_clock::now() - lastCheckpoint >= seconds(5)) {
+                    // Without audio chunks to flush on, flush once in a while so the output can be checkpointed
+                    if (!finishFrames(0)) goto cleanup;
+                    vid32state.flush(outstream.tellp());
+                    std::string vdata = vid32stream.str();
+                    outstream.write(vdata.c_str(), vdata.size());
+                    vid32stream = std::stringstream();
+                    outstream.flush();
+                    checkpoint.offset = outstream.tellp();
+                    checkpoint.frames = nframe;
+                    checkpoint.chunks = nframe_vid32;
+                    checkpoint.videoFrames = vid32state.nvideo;
+                    checkpoint.index = vid32state.index;
+                    checkpoint.duration = totalDuration;
+                    checkpoint.decimationStart = decimationStart;
+                    checkpoint.lastSlot = lastSlot;
+                    writeCheckpoint(output + ".checkpoint", checkpoint);
+                    lastCheckpoint = system_clock::now();
                 }
                 if (streamed) {
                     std::unique_lock<std::mutex> lock(streamedLock);
@@ -1231,7 +2368,7 @@ int main(int argc, const char * argv[]) {
             if (error != AVERROR_EOF && error != AVERROR(EAGAIN)) {
                 std::cerr << "Failed to grab video frame: " << avErrorString(error) << "\n";
             }
-        } else if (packet->stream_index == audio_stream && mode != OutputType::Lua && mode != OutputType::Raw && mode != OutputType::BlitImage && mode != OutputType::NFP && !mute) {
+        } else if (packet->stream_index == audio_stream && (primaryAudio || extraAudio)) {
             avcodec_send_packet(audio_codec_ctx, packet);
             while ((error = avcodec_receive_frame(audio_codec_ctx, frame)) == 0) {
                 AVFrame * newframe = av_frame_alloc();
@@ -1250,6 +2387,19 @@ int main(int argc, const char * argv[]) {
                     av_frame_free(&newframe);
                     continue;
                 }
+                if (clipping && frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+                    // Cut the (mono 8-bit) samples that fall outside of the clip
+                    int64_t t = av_rescale_q(frame->best_effort_timestamp, format_ctx->streams[audio_stream]->time_base, AVRational{1, AV_TIME_BASE}) - inputStart;
+                    int64_t skip = max(av_rescale(audioStart - t, 48000, AV_TIME_BASE), (int64_t)0);
+                    int64_t keep = clipDuration > 0 ? av_rescale(clipEnd - t, 48000, AV_TIME_BASE) : newframe->nb_samples;
+                    if (keep <= 0) audioDone = true;
+                    if (skip >= newframe->nb_samples || keep <= skip) {
+                        av_frame_free(&newframe);
+                        continue;
+                    }
+                    newframe->data[0] += skip;
+                    newframe->nb_samples = min(keep, (int64_t)newframe->nb_samples) - skip;
+                }
                 if (filter_graph) {
                     if ((error = av_buffersrc_add_frame(src_ctx, newframe)) < 0) {
                         std::cerr << "Could not push frame to filter: " << avErrorString(error) << "\n";
@@ -1265,6 +2415,7 @@ int main(int argc, const char * argv[]) {
                     }
                     newframe = newframe2;
                 }
+                std::string extraChunk;
                 if (useDFPWM) {
                     if ((error = avcodec_send_frame(dfpwm_codec_ctx, newframe)) < 0) {
                         std::cerr << "Could not write DFPWM frame: " << avErrorString(error) << "\n";
@@ -1278,21 +2429,32 @@ int main(int argc, const char * argv[]) {
                             std::cerr << "Could not read DFPWM frame: " << avErrorString(error) << "\n";
                             break;
                         }
-                        if (audioStorageSize + dfpwm_packet->size > 0) {
-                            unsigned offset = audioStorageSize < 0 ? -audioStorageSize : 0;
-                            audioStorage = (uint8_t*)realloc(audioStorage, audioStorageSize + dfpwm_packet->size);
-                            memcpy(audioStorage + audioStorageSize + offset, dfpwm_packet->data + offset, dfpwm_packet->size - offset);
+                        if (primaryAudio) {
+                            if (audioStorageSize + dfpwm_packet->size > 0) {
+                                unsigned offset = audioStorageSize < 0 ? -audioStorageSize : 0;
+                                audioStorage = (uint8_t*)realloc(audioStorage, audioStorageSize + dfpwm_packet->size);
+                                memcpy(audioStorage + audioStorageSize + offset, dfpwm_packet->data + offset, dfpwm_packet->size - offset);
+                            }
+                            audioStorageSize += dfpwm_packet->size;
                         }
-                        audioStorageSize += dfpwm_packet->size;
+                        if (extraAudio) extraChunk.append((const char*)dfpwm_packet->data, dfpwm_packet->size);
                         av_packet_unref(dfpwm_packet);
                     }
                 } else {
-                    if (audioStorageSize + newframe->nb_samples > 0) {
-                        unsigned offset = audioStorageSize < 0 ? -audioStorageSize : 0;
-                        audioStorage = (uint8_t*)realloc(audioStorage, audioStorageSize + newframe->nb_samples);
-                        memcpy(audioStorage + audioStorageSize + offset, newframe->data[0] + offset, newframe->nb_samples - offset);
+                    if (primaryAudio) {
+                        if (audioStorageSize + newframe->nb_samples > 0) {
+                            unsigned offset = audioStorageSize < 0 ? -audioStorageSize : 0;
+                            audioStorage = (uint8_t*)realloc(audioStorage, audioStorageSize + newframe->nb_samples);
+                            memcpy(audioStorage + audioStorageSize + offset, newframe->data[0] + offset, newframe->nb_samples - offset);
+                        }
+                        audioStorageSize += newframe->nb_samples;
                     }
-                    audioStorageSize += newframe->nb_samples;
+                    if (extraAudio) extraChunk.assign((const char*)newframe->data[0], newframe->nb_samples);
+                }
+                if (!extraChunk.empty()) {
+                    auto data = std::make_shared<const std::string>(std::move(extraChunk));
+                    for (const auto& o : extraOutputs) o->writeAudio(data);
+                    extraChunk.clear();
                 }
                 if (mode == OutputType::Vid32 && !separateStreams) {
                     uint32_t size = audioStorageSize;
@@ -1300,12 +2462,31 @@ int main(int argc, const char * argv[]) {
                     outstream.put((char)Vid32Chunk::Type::Audio);
                     outstream.write((const char*)audioStorage, size);
                     nframe_vid32++;
+                    audioSamples += useDFPWM ? size * 8 : size;
                     free(audioStorage);
                     audioStorage = NULL;
                     audioStorageSize = 0;
+                    // A checkpoint resumes after the last decoded frame, so every frame still converting must be written first
+                    const bool saveCheckpoint = checkpoints && system_clock::now() - lastCheckpoint >= seconds(5);
+                    if (saveCheckpoint && !finishFrames(0)) goto cleanup;
+                    vid32state.flush(outstream.tellp());
                     std::string vdata = vid32stream.str();
                     outstream.write(vdata.c_str(), vdata.size());
                     vid32stream = std::stringstream();
+                    if (saveCheckpoint) {
+                        outstream.flush();
+                        checkpoint.offset = outstream.tellp();
+                        checkpoint.frames = nframe;
+                        checkpoint.chunks = nframe_vid32;
+                        checkpoint.videoFrames = vid32state.nvideo;
+                        checkpoint.index = vid32state.index;
+                        checkpoint.samples = audioSamples;
+                        checkpoint.duration = totalDuration;
+                        checkpoint.decimationStart = decimationStart;
+                        checkpoint.lastSlot = lastSlot;
+                        writeCheckpoint(output + ".checkpoint", checkpoint);
+                        lastCheckpoint = system_clock::now();
+                    }
                 }
                 av_frame_free(&newframe);
             }
@@ -1314,10 +2495,12 @@ int main(int argc, const char * argv[]) {
             }
         }
         av_packet_unref(packet);
+        if (videoDone && audioDone) break;
 #ifdef STATUS_FUNCTION
         if (externalStop) break;
 #endif
     }
+    if (!finishFrames(0)) goto cleanup;
     if (fps < 1) {
         fps = nframe / (totalDuration * av_q2d(format_ctx->streams[video_stream]->time_base));
         if (mode == OutputType::Vid32 && !separateStreams) {
@@ -1327,6 +2510,7 @@ int main(int argc, const char * argv[]) {
             outstream.seekp(pos, std::ios::beg);
         }
     }
+    for (const auto& o : extraOutputs) o->finish(fps);
     if (mode == OutputType::Vid32 && separateStreams) {
         Vid32Chunk videoChunk, audioChunk;
         Vid32Header header;
@@ -1381,6 +2565,7 @@ int main(int argc, const char * argv[]) {
             vid32subs.clear();
         }
     } else if (mode == OutputType::Vid32 && !separateStreams) {
+        vid32state.flush(outstream.tellp());
         std::string vdata = vid32stream.str();
         outstream.write(vdata.c_str(), vdata.size());
         vid32stream = std::stringstream();
@@ -1388,8 +2573,14 @@ int main(int argc, const char * argv[]) {
         chunk.size = (size_t)outstream.tellp() - 21;
         chunk.nframes = nframe_vid32;
         chunk.type = (uint8_t)Vid32Chunk::Type::Combined;
+        if (!vid32state.index.empty()) {
+            outstream << make32vid_index(vid32state.index, vid32state.indexStep);
+            outstream.seekp(9, std::ios::beg);
+            outstream.put(2);
+        }
         outstream.seekp(12, std::ios::beg);
         outstream.write((const char*)&chunk, 9);
+        if (checkpoints) std::remove((output + ".checkpoint").c_str());
     } else if (mode == OutputType::BlitImage) {
         char timestr[26];
         time_t now = time(0);
@@ -1406,6 +2597,13 @@ int main(int argc, const char * argv[]) {
         outfile << "for i = 0, 15 do term.setPaletteColor(2^i, term.nativePaletteColor(2^i)) end\nterm.setBackgroundColor(colors.black)\nterm.setTextColor(colors.white)\nterm.setCursorPos(1, 1)\nterm.clear()\n";
     }
 cleanup:
+    // Frames that were never written after an error still need the device to finish with them before they're freed
+    for (PendingFrame& pending : pendingFrames) {
+        if (pending.image.onDevice) finishConvertImage(pending.image);
+        if (pending.image.characters) delete[] pending.image.characters;
+        delete[] pending.image.colors;
+    }
+    pendingFrames.clear();
     auto t = system_clock::now() - start;
 #ifdef STATUS_FUNCTION
     STATUS_FUNCTION(nframe, nframe, duration_cast<milliseconds>(t), milliseconds(0), t >= seconds(1) ? floor((double)nframe / duration_cast<seconds>(t).count()) : 0);
@@ -1413,10 +2611,15 @@ cleanup:
     std::cerr << "\rframe " << nframe << "/" << nframe << " (elapsed " << t << ", remaining 00:00, " << floor((double)nframe / duration_cast<seconds>(t).count()) << " fps)\n";
 #endif
 #ifdef HAS_OPENCL
-    if (device != NULL) delete device;
+    // A device that is still opening fills devicePool from its own thread, so it's left to exit with the process
+    if (pendingDevice.valid() && !takeDevice()) abandonDevice();
+    else if (!keepDevice) closeDevices();
 #endif
     if (outfile.is_open()) outfile.close();
-    if (resize_ctx) sws_freeContext(resize_ctx);
+    for (SwsContext * ctx : resize_ctx) sws_freeContext(ctx);
+    for (SwsContext * ctx : prescale_ctx) sws_freeContext(ctx);
+    for (LadderRung& rung : ladder) for (SwsContext * ctx : rung.resize_ctx) sws_freeContext(ctx);
+    if (prescaled) av_frame_free(&prescaled);
     if (resample_ctx) swr_free(&resample_ctx);
     av_frame_free(&frame);
     av_packet_free(&packet);
@@ -1469,3 +2672,116 @@ cleanup:
 #endif
     return 0;
 }
+
+// Returns the file extension for files written in the current output mode
+static std::string outputExtension() {
+    switch (mode) {
+    case OutputType::NFP: return ".nfp";
+    case OutputType::Raw: return ".vid";
+    case OutputType::BlitImage: return ".bimg";
+    case OutputType::Vid32: return ".32v";
+    default: return ".lua";
+    }
+}
+
+// Splits a batch between --batch-jobs worker processes, which each convert their share of the files in a batch of their own
+// The conversion state is global, so jobs can't run at the same time in one process
+static int runBatchWorkers(const char * argv0, const std::vector<std::string>& args, const std::vector<std::pair<std::string, std::string>>& jobs) {
+    size_t n = min((size_t)batchJobs, jobs.size());
+    std::vector<std::string> manifests;
+    std::vector<Poco::ProcessHandle> processes;
+    int retval = 0;
+    for (size_t i = 0; i < n; i++) {
+        manifests.push_back(Poco::TemporaryFile::tempName());
+        {
+            std::ofstream out(manifests.back());
+            for (size_t j = i; j < jobs.size(); j += n) out << jobs[j].first << "\t" << jobs[j].second << "\n";
+            if (!out.good()) {
+                std::cerr << "Could not write batch manifest " << manifests.back() << "\n";
+                retval = 1;
+                break;
+            }
+        }
+        Poco::Process::Args workerArgs(args.begin(), args.end());
+        workerArgs.push_back("--batch=" + manifests.back());
+        try {
+            processes.push_back(Poco::Process::launch(argv0, workerArgs));
+        } catch (Poco::Exception &e) {
+            std::cerr << "Could not start batch worker " << i << ": " << e.displayText() << "\n";
+            retval = 1;
+            break;
+        }
+    }
+    for (Poco::ProcessHandle& process : processes) if (process.wait() != 0) retval = 1;
+    for (const std::string& manifest : manifests) std::remove(manifest.c_str());
+    if (retval) std::cerr << "One or more batch workers could not convert all of their files\n";
+    return retval;
+}
+
+// Converts every job of a batch in this process, so the work queue and OpenCL device are only set up once
+static int runBatch(const char * argv0, const std::vector<std::string>& args) {
+    std::vector<std::pair<std::string, std::string>> jobs;
+    try {
+        Poco::File dir(batchPath);
+        if (dir.isDirectory()) {
+            if (output.empty()) {
+                std::cerr << "Converting a directory requires an output directory (-o)\n";
+                return 1;
+            }
+            Poco::File(output).createDirectories();
+            std::vector<std::string> names;
+            dir.list(names);
+            std::sort(names.begin(), names.end());
+            for (const std::string& name : names) {
+                std::string path = batchPath + "/" + name;
+                if (name[0] != '.' && Poco::File(path).isFile()) jobs.push_back(std::make_pair(path, output + "/" + Poco::Path(name).getBaseName() + outputExtension()));
+            }
+        } else {
+            std::ifstream in(batchPath);
+            if (!in.is_open()) {
+                std::cerr << "Could not open batch manifest " << batchPath << "\n";
+                return 1;
+            }
+            std::string line;
+            for (int n = 1; std::getline(in, line); n++) {
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                if (line.empty() || line[0] == '#') continue;
+                size_t pos = line.find('\t');
+                if (pos == std::string::npos || pos == 0 || pos + 1 == line.size()) {
+                    std::cerr << batchPath << ":" << n << ": expected an input and output path separated by a tab\n";
+                    return 1;
+                }
+                jobs.push_back(std::make_pair(line.substr(0, pos), line.substr(pos + 1)));
+            }
+        }
+    } catch (Poco::Exception &e) {
+        std::cerr << "Could not read batch " << batchPath << ": " << e.displayText() << "\n";
+        return 1;
+    }
+    if (batchJobs > 1 && jobs.size() > 1) return runBatchWorkers(argv0, args, jobs);
+#ifdef HAS_OPENCL
+    if (!disableOpenCL) device = openDevice();
+#endif
+    keepDevice = true;
+    int failed = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        std::cerr << "[" << (i + 1) << "/" << jobs.size() << "] " << jobs[i].first << "\n";
+        std::vector<std::string> jobArgs(args);
+        jobArgs.push_back("--input=" + jobs[i].first);
+        jobArgs.push_back("--output=" + jobs[i].second);
+        std::vector<const char*> argv {argv0};
+        for (const std::string& arg : jobArgs) argv.push_back(arg.c_str());
+        if (convert(argv.size(), argv.data()) != 0) {
+            std::cerr << "Could not convert " << jobs[i].first << "\n";
+            failed++;
+        }
+    }
+    keepDevice = false;
+    closeDevices();
+    if (failed) std::cerr << failed << " of " << jobs.size() << " files failed to convert\n";
+    return failed ? 1 : 0;
+}
+
+int main(int argc, const char * argv[]) {
+    return convert(argc, argv);
+}
@@ -27,8 +27,13 @@
 #include <condition_variable>
 #include <thread>
 #include <functional>
+#include <memory>
+#include <new>
+#include <algorithm>
 #include <atomic>
 #include <stdexcept>
+#include <string>
+#include <ostream>
 
 #ifdef HAS_OPENCL
 #include "opencl.hpp"
@@ -78,75 +83,125 @@ struct Vec3b : public std::array<uint8_t, 3> {
     operator uchar3() const {return {(*this)[0], (*this)[1], (*this)[2]};}
 };
 
+/* Allocator for page-aligned storage, which OpenCL devices sharing memory with the host can use without copying. */
+template<typename T>
+struct PageAllocator {
+    typedef T value_type;
+    PageAllocator() = default;
+    template<typename U> PageAllocator(const PageAllocator<U>&) {}
+    T * allocate(size_t n) {return (T*)::operator new(n * sizeof(T), std::align_val_t(4096));}
+    void deallocate(T * p, size_t) {::operator delete(p, std::align_val_t(4096));}
+    template<typename U> bool operator==(const PageAllocator<U>&) const {return true;}
+    template<typename U> bool operator!=(const PageAllocator<U>&) const {return false;}
+};
+
 template<typename T>
 class vector2d {
 public:
     unsigned width;
     unsigned height;
-    std::vector<T> vec;
+    unsigned stride; // distance between rows, in elements; only differs from width for views
+    std::vector<T, PageAllocator<T>> vec;
+    T * base = NULL; // start of the viewed data for views, NULL when this owns its data in vec
+    std::shared_ptr<void> owner; // keeps the data behind a view alive
 #ifdef HAS_OPENCL
     std::shared_ptr<OpenCL::Memory<T>> mem;
 #endif
     bool onHost = true, onDevice = false;
     class row {
-        std::vector<T> * vec;
-        unsigned ypos;
+        T * ptr;
         unsigned size;
     public:
-        row(std::vector<T> *v, unsigned y, unsigned s): vec(v), ypos(y), size(s) {}
+        row(T *p, unsigned s): ptr(p), size(s) {}
         T& operator[](unsigned idx) { 
             if (idx >= size) throw std::out_of_range("Vector2D index out of range");
-            return (*vec)[ypos+idx];
+            return ptr[idx];
         }
-        row& operator=(std::vector<T> v) {std::copy(v.begin(), v.begin() + (v.size() > size ? v.size() : size), vec->begin() + ypos); return *this;}
-        row& operator=(row v) {std::copy(v.vec->begin() + v.ypos, v.vec->begin() + v.ypos + v.size, vec->begin() + ypos); return *this;}
+        row& operator=(std::vector<T> v) {std::copy(v.begin(), v.begin() + (v.size() > size ? v.size() : size), ptr); return *this;}
+        row& operator=(row v) {std::copy(v.ptr, v.ptr + v.size, ptr); return *this;}
     };
     class const_row {
-        const std::vector<T> * vec;
-        unsigned ypos;
+        const T * ptr;
         unsigned size;
     public:
-        const_row(const std::vector<T> *v, unsigned y, unsigned s): vec(v), ypos(y), size(s) {}
+        const_row(const T *p, unsigned s): ptr(p), size(s) {}
         const T& operator[](unsigned idx) const { 
             if (idx >= size) throw std::out_of_range("Vector2D index out of range");
-            return (*vec)[ypos+idx];
+            return ptr[idx];
         }
-        row& operator=(std::vector<T> v) {std::copy(v.begin(), v.begin() + (v.size() > size ? v.size() : size), vec->begin() + ypos); return *this;}
-        row& operator=(row v) {std::copy(v.vec->begin() + v.ypos, v.vec->begin() + v.ypos + v.size, vec->begin() + ypos); return *this;}
     };
-    vector2d(): width(0), height(0), vec() {}
-    vector2d(unsigned w, unsigned h, T v = T()): width(w), height(h), vec((size_t)w*h, v) {}
-    vector2d(unsigned w, unsigned h, OpenCL::Device * dev, T v = T()): width(w), height(h), vec((size_t)w*h, v) {
+    vector2d(): width(0), height(0), stride(0), vec() {}
+    vector2d(unsigned w, unsigned h, T v = T()): width(w), height(h), stride(w), vec((size_t)w*h, v) {}
+    // slack reserves extra elements past the end, for writers that may overrun the last row (e.g. swscale)
+    vector2d(unsigned w, unsigned h, OpenCL::Device * dev, T v = T(), size_t slack = 0): width(w), height(h), stride(w), vec((size_t)w*h + slack, v) {
 #ifdef HAS_OPENCL
         if (dev != NULL) mem = std::make_shared<OpenCL::Memory<T>>(*dev, w * h, 1, vec.data());
 #endif
     }
+    // Creates a view over external data; rows are s elements apart, and o is held until the view is destroyed
+    vector2d(T * data, unsigned w, unsigned h, unsigned s, std::shared_ptr<void> o, OpenCL::Device * dev = NULL): width(w), height(h), stride(s), base(data), owner(o) {
+#ifdef HAS_OPENCL
+        if (dev != NULL) {
+            if (s == w) mem = std::make_shared<OpenCL::Memory<T>>(*dev, w * h, 1, data);
+            else mem = std::make_shared<OpenCL::Memory<T>>(*dev, w * h, 1, true, true, T());
+        }
+#endif
+    }
+    T * data() {return base ? base : vec.data();}
+    const T * data() const {return base ? base : vec.data();}
+    /**
+     * Returns a view of a rectangle inside this image, without copying it.
+     * The view stays valid while this image's storage is alive and unresized.
+     */
+    vector2d view(unsigned x, unsigned y, unsigned w, unsigned h, OpenCL::Device * dev = NULL) {
+        if (x + w > width || y + h > height) throw std::out_of_range("Vector2D view out of range");
+        download();
+        return vector2d(data() + (size_t)y * stride + x, w, h, stride, owner, dev);
+    }
     row operator[](unsigned idx) {
         if (idx >= height) throw std::out_of_range("Vector2D index out of range");
-        return row(&vec, idx * width, width);
+        return row(data() + (size_t)idx * stride, width);
     }
     const const_row operator[](unsigned idx) const {
         if (idx >= height) throw std::out_of_range("Vector2D index out of range");
-        return const_row(&vec, idx * width, width);
+        return const_row(data() + (size_t)idx * stride, width);
     }
     T& at(unsigned y, unsigned x) {
         if (y >= height || x >= width) throw std::out_of_range("Vector2D index out of range");
-        return vec[y*width+x];
+        return data()[(size_t)y*stride+x];
     }
     const T& at(unsigned y, unsigned x) const {
         if (y >= height || x >= width) throw std::out_of_range("Vector2D index out of range");
-        return vec[y*width+x];
+        return data()[(size_t)y*stride+x];
     }
     void remove_last_line() {vec.resize(width*--height);}
+    // Gives an image that was made on the CPU device memory on dev, so it can be passed to the device version of a function
+    void attach(OpenCL::Device * dev) {
+#ifdef HAS_OPENCL
+        if (dev == NULL || mem != NULL) return;
+        download();
+        if (base == NULL || stride == width) mem = std::make_shared<OpenCL::Memory<T>>(*dev, width * height, 1, data());
+        else mem = std::make_shared<OpenCL::Memory<T>>(*dev, width * height, 1, true, true, T());
+        onDevice = false;
+#endif
+    }
     void download() {
 #ifdef HAS_OPENCL
-        if (mem != NULL && !onHost && onDevice) mem->read_from_device();
+        if (mem != NULL && !onHost && onDevice) {
+            mem->read_from_device();
+            if (base != NULL && stride != width)
+                for (unsigned y = 0; y < height; y++) std::copy(mem->data() + (size_t)y * width, mem->data() + (size_t)(y + 1) * width, base + (size_t)y * stride);
+        }
 #endif
         onHost = true;
     }
     void upload() {
 #ifdef HAS_OPENCL
-        if (mem != NULL && !onDevice && onHost) mem->write_to_device();
+        if (mem != NULL && !onDevice && onHost) {
+            if (base != NULL && stride != width)
+                for (unsigned y = 0; y < height; y++) std::copy(base + (size_t)y * stride, base + (size_t)y * stride + width, mem->data() + (size_t)y * width);
+            mem->enqueue_transfer_to_device();
+        }
 #endif
         onDevice = true;
     }
@@ -213,6 +268,67 @@ public:
 
 typedef vector2d<uint8_t> Mat1b;
 typedef vector2d<uchar3> Mat;
+
+/* Class for recycling same-sized frame buffers between frames. */
+template<typename T>
+class FramePool {
+    std::vector<vector2d<T>*> pool;
+    std::mutex lock;
+    unsigned width, height;
+    size_t slack;
+    OpenCL::Device * device;
+public:
+    FramePool(unsigned w, unsigned h, OpenCL::Device * dev = NULL, size_t s = 0): width(w), height(h), slack(s), device(dev) {}
+    ~FramePool() {for (vector2d<T> * f : pool) delete f;}
+    /**
+     * Takes a buffer out of the pool, allocating a new one if none are free.
+     * The buffer is returned to the pool once the last reference is dropped,
+     * so the pool must outlive every buffer it hands out.
+     */
+    std::shared_ptr<vector2d<T>> acquire() {
+        vector2d<T> * f;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (pool.empty()) f = NULL;
+            else {f = pool.back(); pool.pop_back();}
+        }
+        if (f == NULL) f = new vector2d<T>(width, height, device, T(), slack);
+        f->onHost = true;
+        f->onDevice = false;
+        return std::shared_ptr<vector2d<T>>(f, [this](vector2d<T> * p) {
+            std::lock_guard<std::mutex> guard(lock);
+            pool.push_back(p);
+        });
+    }
+};
+
+/* A conversion running on an OpenCL device, started by startConvertImage_device. */
+struct DeviceConversion {
+    uchar * chars = NULL, * cols = NULL; // being read back from the device until finished
+    uchar palette[48];
+    bool lab = false;
+    bool started = false;
+#ifdef HAS_OPENCL
+    cl::Event done; // completes once every result has been read back
+#endif
+    DeviceConversion() = default;
+    DeviceConversion(const DeviceConversion&) = delete;
+    // Whether the device is done with this conversion, so finishing it won't wait
+    bool ready() const {
+#ifdef HAS_OPENCL
+        return !started || done.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() == CL_COMPLETE;
+#else
+        return true;
+#endif
+    }
+    ~DeviceConversion() {
+#ifdef HAS_OPENCL
+        if (started) done.wait(); // the device may still be writing into the arrays
+#endif
+        if (chars) delete[] chars;
+        if (cols) delete[] cols;
+    }
+};
 #undef min
 #undef max
 template<typename T> inline T min(T a, T b) {return a < b ? a : b;}
@@ -259,6 +375,7 @@ struct Vid32Chunk {
         Subtitle4,
         Combined,
         CombinedIndex,
+        VideoDelta,
 
         MultiMonitorVideo = 64
     };
@@ -381,6 +498,15 @@ extern Mat thresholdImage(Mat& image, const std::vector<Vec3b>& palette, OpenCL:
  * @return A reduced-color version of the image using the palette
  */
 extern Mat ditherImage(Mat& image, const std::vector<Vec3b>& palette, OpenCL::Device * device = NULL);
+/**
+ * Checks that Floyd-Steinberg dithering on a device matches the CPU, and
+ * enables it for that device if it does. Until this passes, ditherImage runs on
+ * the CPU.
+ * @param device The device to check
+ * @return 1 if the device can dither, 0 if its results differ from the CPU, or
+ *         -1 if it never finished, in which case the device can't be used
+ */
+extern int checkDitherDevice(OpenCL::Device * device);
 /**
  * Reduces the colors in an image using the specified palette through ordered
  * dithering.
@@ -397,6 +523,30 @@ extern Mat ditherImage_ordered(Mat& image, const std::vector<Vec3b>& palette, Op
  * @return An indexed version of the image
  */
 extern Mat1b rgbToPaletteImage(Mat& image, const std::vector<Vec3b>& palette, OpenCL::Device * device = NULL);
+/**
+ * Starts converting an image into CC characters and colors with a median cut
+ * palette, keeping every step on the OpenCL device. The results are read back
+ * on the device's transfer queue, so another image can be started in a
+ * different slot before this one is finished.
+ * @param image The image to convert
+ * @param lab Whether the image is in Lab color space
+ * @param dither Whether to dither the image instead of thresholding it
+ * @param nfp Whether to make an NFP-quality image (without characters)
+ * @param slot The set of result buffers to use; images in flight at the same
+ *             time need different slots
+ * @param conversion The conversion to start, which must not be started yet
+ * @return Whether the conversion was started; false if the device can't handle
+ *         these options, in which case the separate steps should be used
+ */
+extern bool startConvertImage_device(Mat& image, bool lab, bool dither, bool nfp, int slot, DeviceConversion& conversion, OpenCL::Device * device);
+/**
+ * Waits for a conversion started with startConvertImage_device to finish.
+ * @param conversion The conversion to finish
+ * @param chars A pointer to store the character array in (NULL for NFP)
+ * @param cols A pointer to store the color array in
+ * @param palette A vector to store the RGB palette in
+ */
+extern void finishConvertImage_device(DeviceConversion& conversion, uchar** chars, uchar** cols, std::vector<Vec3b>& palette);
 
 /* generator */
 /**
@@ -491,3 +641,31 @@ extern std::string make32vid_cmp(const uchar * characters, const uchar * colors,
  * @return The generated 32vid frame
  */
 extern std::string make32vid_ans(const uchar * characters, const uchar * colors, const std::vector<Vec3b>& palette, int width, int height);
+/**
+ * Generates a 32vid delta frame, which only stores the cells that changed since the last frame, using ANS compression.
+ * @param characters The character array to use
+ * @param colors The color pair array to use
+ * @param palette The palette for the image
+ * @param lastCharacters The character array of the last frame
+ * @param lastColors The color pair array of the last frame
+ * @param width The width of the image in characters
+ * @param height The height of the image in characters
+ * @return The generated 32vid delta frame
+ */
+extern std::string make32vid_delta(const uchar * characters, const uchar * colors, const std::vector<Vec3b>& palette, const uchar * lastCharacters, const uchar * lastColors, int width, int height);
+/**
+ * Generates a CombinedIndex chunk for a combined 32vid stream, including the chunk header.
+ * @param offsets The file offsets of every indexed video frame
+ * @param step The number of video frames between each indexed frame
+ * @return The generated index chunk
+ */
+extern std::string make32vid_index(const std::vector<uint32_t>& offsets, uint8_t step);
+/**
+ * Concatenates 32vid files that each hold a single Combined chunk into one video.
+ * If a part's audio is shorter than its video, silence is inserted after it so
+ * that the following parts stay in sync.
+ * @param inputs The paths to the parts to merge, in playback order
+ * @param out The stream to write the merged video to
+ * @return An error message, or an empty string on success
+ */
+extern std::string merge32vid(const std::vector<std::string>& inputs, std::ostream& out);
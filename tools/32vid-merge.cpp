@@ -0,0 +1,46 @@
+/*
+ * 32vid-merge.cpp
+ * Joins partial 32vid files created with `sanjuuni --shard` into one video.
+ * Copyright (C) 2025 JackMacWindows
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <fstream>
+#include <iostream>
+#include "sanjuuni.hpp"
+
+WorkQueue work;
+
+int main(int argc, const char * argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <output.32v> <part0.32v> [part1.32v...]\n";
+        return 1;
+    }
+    std::vector<std::string> inputs(argv + 2, argv + argc);
+    std::ofstream out(argv[1], std::ios::out | std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "Error: Could not open output file " << argv[1] << "\n";
+        return 2;
+    }
+    std::string err = merge32vid(inputs, out);
+    if (!err.empty()) {
+        std::cerr << "Error: " << err << "\n";
+        out.close();
+        std::remove(argv[1]);
+        return 2;
+    }
+    return 0;
+}
@@ -44,7 +44,7 @@ public:
         if (*(uint32_t*)h.magic != SDL_FOURCC('3', '2', 'V', 'D')) {
             throw std::invalid_argument("Not a 32Vid file");
         }
-        if (h.nstreams != 1) {
+        if (h.nstreams < 1 || h.nstreams > 2) {
             throw std::invalid_argument("Separate stream files not supported by this tool");
         }
         if ((h.flags & 3) != 1) {
@@ -81,7 +81,7 @@ public:
     }
 
     Vid32Frame* NextFrame() {
-        if (nframe++ > totalFrames) {
+        if (nframe++ >= totalFrames) {
             return nullptr;
         }
         uint32_t size;
@@ -277,21 +277,69 @@ int main(int argc, const char* argv[]) {
     SDL_ResumeAudioStreamDevice(audio);
     DFPWMState dfpwm = {0, 0, 0, -128};
     int vidframe = 0;
+    std::vector<uint8_t> screen, bgcolors, fgcolors; // kept across frames for delta frames
     SDL_Time videoStart;
     SDL_GetCurrentTime(&videoStart);
     while (true) {
         Vid32Frame* frame = demux.NextFrame();
         if (frame == nullptr) break;
-        if (frame->type == 0) {
+        if (frame->type == 0 || frame->type == (uint8_t)Vid32Chunk::Type::VideoDelta) {
             vidframe++;
-            Vid32Decoder sdec(frame->data, false);
-            uint8_t* screen = sdec.read(demux.GetWidth() * demux.GetHeight());
-            Vid32Decoder cdec(sdec.endPointer(), true);
-            uint8_t* bgcolors = cdec.read(demux.GetWidth() * demux.GetHeight());
-            uint8_t* fgcolors = cdec.read(demux.GetWidth() * demux.GetHeight());
+            const size_t size = demux.GetWidth() * demux.GetHeight();
+            uint8_t* pal;
+            if (frame->type == 0) {
+                Vid32Decoder sdec(frame->data, false);
+                uint8_t* s = sdec.read(size);
+                Vid32Decoder cdec(sdec.endPointer(), true);
+                uint8_t* b = cdec.read(size);
+                uint8_t* f = cdec.read(size);
+                screen.assign(s, s + size);
+                bgcolors.assign(b, b + size);
+                fgcolors.assign(f, f + size);
+                delete[] s;
+                delete[] b;
+                delete[] f;
+                pal = cdec.endPointer();
+            } else {
+                // delta frame: runs of unchanged/changed cells, then the changed cells as an n*1 frame
+                if (screen.size() != size) {
+                    std::cerr << "Delta frame without a previous frame\n";
+                    free(frame);
+                    break;
+                }
+                std::vector<size_t> changed;
+                uint8_t* p = frame->data;
+                bool isChanged = false;
+                for (size_t pos = 0; pos < size; isChanged = !isChanged) {
+                    uint32_t n = 0;
+                    for (int shift = 0; ; shift += 7) {
+                        n |= (*p & 0x7F) << shift;
+                        if (!(*p++ & 0x80)) break;
+                    }
+                    if (isChanged) for (size_t i = pos; i < pos + n && i < size; i++) changed.push_back(i);
+                    pos += n;
+                }
+                pal = p;
+                if (!changed.empty()) {
+                    Vid32Decoder sdec(p, false);
+                    uint8_t* s = sdec.read(changed.size());
+                    Vid32Decoder cdec(sdec.endPointer(), true);
+                    uint8_t* b = cdec.read(changed.size());
+                    uint8_t* f = cdec.read(changed.size());
+                    for (size_t i = 0; i < changed.size(); i++) {
+                        screen[changed[i]] = s[i];
+                        bgcolors[changed[i]] = b[i];
+                        fgcolors[changed[i]] = f[i];
+                    }
+                    delete[] s;
+                    delete[] b;
+                    delete[] f;
+                    pal = cdec.endPointer();
+                }
+            }
             uint32_t palette[16];
             for (int i = 0; i < 16; i++) {
-                palette[i] = SDL_MapRGB(pixdetail, NULL, cdec.endPointer()[i * 3], cdec.endPointer()[i * 3 + 1], cdec.endPointer()[i * 3 + 2]);
+                palette[i] = SDL_MapRGB(pixdetail, NULL, pal[i * 3], pal[i * 3 + 1], pal[i * 3 + 2]);
             }
             for (int y = 0; y < demux.GetHeight(); y++) {
                 for (int x = 0; x < demux.GetWidth(); x++) {
@@ -312,9 +360,6 @@ int main(int argc, const char* argv[]) {
                 }
             }
             SDL_UpdateWindowSurface(win);
-            delete[] screen;
-            delete[] fgcolors;
-            delete[] bgcolors;
             SDL_Event ev;
             SDL_Time now;
             while (SDL_GetCurrentTime(&now), SDL_WaitEventTimeout(&ev, ((videoStart + (unsigned long long)vidframe * 1000000000ULL / demux.GetFPS()) - now) / 1000000)) {
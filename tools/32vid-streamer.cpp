@@ -565,7 +565,7 @@ int main(int argc, const char * argv[]) {
             } case 12: {
 
             }
-            case 3: case 4: case 5: case 6: case 7: case 9: case 10: case 11:
+            case 3: case 4: case 5: case 6: case 7: case 9: case 10: case 11: case 13:
                 in.seekg(c.size, std::ios::cur);
                 break;
             default:
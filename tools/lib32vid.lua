@@ -28,6 +28,7 @@ local blitColors = {[0] = "0", "1", "2", "3", "4", "5", "6", "7", "8", "9", "a",
 ---@class lib32vid
 ---@field read fun(n: number): string|nil
 ---@field read fun(): number|nil
+---@field seek fun(whence: string|nil, offset: number|nil): number|nil
 ---@field width number
 ---@field height number
 ---@field fps number
@@ -36,6 +37,12 @@ local blitColors = {[0] = "0", "1", "2", "3", "4", "5", "6", "7", "8", "9", "a",
 ---@field currentframe number
 ---@field vframe number
 ---@field subs table
+---@field nstreams number
+---@field streamEnd number
+---@field index table|false|nil
+---@field screen table|nil
+---@field bg table|nil
+---@field fg table|nil
 local lib32vid = {}
 local lib32vid_mt = {__index = lib32vid}
 
@@ -56,6 +63,13 @@ function lib32vid.load(data)
         pos = pos + bytes
         return str
     end
+    function obj.seek(whence, offset)
+        whence, offset = whence or "cur", offset or 0
+        if whence == "set" then pos = offset + 1
+        elseif whence == "end" then pos = #data + offset + 1
+        else pos = pos + offset end
+        return pos - 1
+    end
     return obj:init()
 end
 
@@ -66,6 +80,7 @@ function lib32vid.open(path)
     local file = assert(fs.open(path, "rb"))
     local obj = setmetatable({}, lib32vid_mt)
     obj.read = file.read
+    obj.seek = file.seek
     obj.close = file.close
     return obj:init()
 end
@@ -78,6 +93,7 @@ function lib32vid.get(url, headers)
     local handle = assert(http.get(url, headers, true))
     local obj = setmetatable({}, lib32vid_mt)
     obj.read = handle.read
+    obj.seek = handle.seek
     obj.close = handle.close
     return obj:init()
 end
@@ -90,12 +106,14 @@ function lib32vid:init()
     if not data then self:close() error("Incomplete 32Vid file", 2) end
     local width, height, fps, nstreams, flags = ("<HHBBH"):unpack(data)
     --print(width, height, fps, nstreams, flags)
-    if nstreams ~= 1 then self:close() error("Separate stream files not supported by this tool", 2) end
+    if nstreams ~= 1 and nstreams ~= 2 then self:close() error("Separate stream files not supported by this tool", 2) end
     if bit32_band(flags, 1) == 0 then self:close() error("DEFLATE or no compression not supported by this tool", 2) end
     data = self.read(9)
     if not data then self:close() error("Incomplete 32Vid file", 2) end
-    local _, nframes, ctype = ("<IIB"):unpack(data)
+    local size, nframes, ctype = ("<IIB"):unpack(data)
     if ctype ~= 0x0C then self:close() error("Stream type not supported by this tool", 2) end
+    self.nstreams = nstreams
+    self.streamEnd = 21 + size
     self.width = width
     self.height = height
     self.fps = fps
@@ -188,22 +206,50 @@ end
 ---@return number|nil monitorY If a multimonitor video frame, the Y position of the monitor
 function lib32vid:next()
     if self.currentframe > self.nframes then return end
+    -- the frame count restarts after seeking, so check for the end of the stream too
+    if self.seek and self.seek() >= self.streamEnd then return end
     local d = self.read(5)
     if not d then return end
     local size, ftype = ("<IB"):unpack(d)
+    self.currentframe = self.currentframe + 1
     --print(size, ftype, file.seek())
-    if ftype == 0 then
+    if ftype == 0 or ftype == 14 then
         --local dcstart = os.epoch "utc"
-        --print("init screen", vframe, file.seek())
-        self.coder_init(false)
-        --print("read screen", vframe, file.seek())
-        local screen = self.coder_read(self.width * self.height)
-        --print("init colors", vframe, file.seek())
-        self.coder_init(true)
-        --print("read bg colors", vframe)
-        local bg = self.coder_read(self.width * self.height)
-        --print("read fg colors", vframe)
-        local fg = self.coder_read(self.width * self.height)
+        if ftype == 0 then
+            --print("init screen", vframe, file.seek())
+            self.coder_init(false)
+            --print("read screen", vframe, file.seek())
+            self.screen = self.coder_read(self.width * self.height)
+            --print("init colors", vframe, file.seek())
+            self.coder_init(true)
+            --print("read bg colors", vframe)
+            self.bg = self.coder_read(self.width * self.height)
+            --print("read fg colors", vframe)
+            self.fg = self.coder_read(self.width * self.height)
+        else
+            -- delta frame: only the changed cells are stored, the rest are kept from the last frame
+            if not self.screen then error("Delta frame without a previous frame", 2) end
+            local changed, pos, isChanged = {}, 0, false
+            while pos < self.width * self.height do
+                local n, shift = 0, 1
+                repeat
+                    local b = self.read()
+                    if not b then error("Incomplete frame", 2) end
+                    n, shift = n + bit32_band(b, 0x7F) * shift, shift * 128
+                until b < 0x80
+                if isChanged then for i = pos + 1, pos + n do changed[#changed+1] = i end end
+                pos, isChanged = pos + n, not isChanged
+            end
+            if #changed > 0 then
+                self.coder_init(false)
+                local s = self.coder_read(#changed)
+                self.coder_init(true)
+                local b = self.coder_read(#changed)
+                local f = self.coder_read(#changed)
+                for i, p in ipairs(changed) do self.screen[p], self.bg[p], self.fg[p] = s[i], b[i], f[i] end
+            end
+        end
+        local screen, bg, fg = self.screen, self.bg, self.fg
         --local dctime = os.epoch "utc" - dcstart
         local bimg = {palette = {}}
         for y = 0, self.height - 1 do
@@ -296,6 +342,39 @@ function lib32vid:next()
     else error("Unknown frame type " .. ftype, 2) end
 end
 
+--- Seeks to the closest indexed video frame at or before a frame, using the
+--- file's index table. The next video frame returned will be that frame.
+---@param frame number The video frame to seek to, starting at 0
+---@return number|nil frame The frame that was seeked to, or nil if the file has no index or can't seek
+function lib32vid:seekFrame(frame)
+    if not self.seek then return nil end
+    if self.index == nil then
+        self.index = false
+        if self.nstreams == 2 then
+            local pos = self.seek()
+            self.seek("set", self.streamEnd)
+            local data = self.read(9)
+            if data then
+                local _, n, ctype = ("<IIB"):unpack(data)
+                local step = self.read()
+                data = self.read(n * 4)
+                if ctype == 0x0D and step and step > 0 and data and #data == n * 4 then
+                    local index = {step = step}
+                    for i = 1, n do index[i] = ("<I"):unpack(data, i * 4 - 3) end
+                    self.index = index
+                end
+            end
+            self.seek("set", pos)
+        end
+    end
+    if not self.index or #self.index == 0 then return nil end
+    local entry = math.max(math.min(math.floor(frame / self.index.step), #self.index - 1), 0)
+    self.seek("set", self.index[entry+1])
+    self.currentframe = 1
+    self.vframe = entry * self.index.step
+    return self.vframe
+end
+
 --- Closes the underlying data stream.
 function lib32vid:close()
     -- do nothing, default impl